@@ -66,9 +66,33 @@
 char		*rdostring = "read-only file";
 char		*cowstring = "copy-on-write file";
 
+/*
+** options that can be specified when activating a cowdevice
+*/
+struct pairopt {
+	char		*name;
+	unsigned long	flag;
+} pairopts[] = {
+	{ "aio",	PAIRAIO	},
+	{ "journal",	PAIRJOURNAL	},
+	{ "zero",	PAIRZERO	},
+	{ "nocache",	PAIRNOCACHE	},
+	{ "dense",	PAIRDENSE	},
+	{ "compress",	PAIRCOMPRESS	},
+	{ "dedup",	PAIRDEDUP	},
+};
+
+/*
+** lower cowfiles that are specified when activating a cowdevice
+** (lowest first)
+*/
+char		*lowfiles[COWMAXLAYERS];
+int		nrlowfiles;
+
 static void	pairlist(void);
-static void	pairadd (char *, char *, char *);
+static void	pairadd (char *, char *, char *, unsigned long, unsigned long);
 static void	pairdel (char *);
+static unsigned long	pairflags(char *, unsigned long *);
 
 static void	prusage (char *);
 static dev_t	new_decode_dev(dev_t);
@@ -76,11 +100,15 @@ static dev_t	new_decode_dev(dev_t);
 int
 main(int argc, char *argv[])
 {
+	char		*prog  = argv[0];
+	unsigned long	flags  = 0;
+	unsigned long	mapunit = 0;
+
 	/*
 	** verify arguments
 	*/
 	if (argc < 2 || argv[1][0] != '-' || strlen(argv[1]) != 2) {
-		prusage(argv[0]);
+		prusage(prog);
 		exit(1);
 	}
 
@@ -90,30 +118,39 @@ main(int argc, char *argv[])
 	switch (argv[1][1]) {
 	   case 'l':			/* list cowdevices  */
 		if (argc != 2) {
-			prusage(argv[0]);
+			prusage(prog);
 			exit(1);
 		}
 		pairlist();
 		break;
 
 	   case 'a':			/* activate cowdevice    */
+		/*
+		** optional flag -o with comma-separated list of options
+		*/
+		if (argc > 3 && strcmp(argv[2], "-o") == 0) {
+			flags  = pairflags(argv[3], &mapunit);
+			argc  -= 2;
+			argv  += 2;
+		}
+
 		if (argc < 4 || argc > 5) {
-			prusage(argv[0]);
+			prusage(prog);
 			exit(1);
 		}
-		pairadd(argv[2], argv[3], argv[4]);
+		pairadd(argv[2], argv[3], argv[4], flags, mapunit);
 		break;
 
 	   case 'd':			/* deactivate cowdevice */
 		if (argc != 3) {
-			prusage(argv[0]);
+			prusage(prog);
 			exit(1);
 		}
 		pairdel(argv[2]);
 		break;
 
 	   default:			/* wrong flag     */
-		prusage(argv[0]);
+		prusage(prog);
 		exit(1);
 	}
 
@@ -182,11 +219,15 @@ pairlist(void)
 ** activate a cowdevice
 */
 static void
-pairadd (char *rdopath, char *cowpath, char *prefdev)
+pairadd (char *rdopath, char *cowpath, char *prefdev, unsigned long flags,
+							unsigned long mapunit)
 {
 	int		fd;
 	struct cowpair	cowpair;
 	struct stat	statinfo;
+	unsigned long	lowflen;
+	char		*lowbuf = NULL, *p;
+	int		i;
 
 	/*
 	** open cowloop
@@ -196,6 +237,23 @@ pairadd (char *rdopath, char *cowpath, char *prefdev)
 		exit(2);
 	}
 
+	/*
+	** concatenate the pathnames of the lower cowfiles (if any),
+	** each terminated by a null byte
+	*/
+	for (i=0, lowflen=0; i < nrlowfiles; i++)
+		lowflen += strlen(lowfiles[i]) + 1;
+
+	if (lowflen) {
+		if ( (lowbuf = malloc(lowflen)) == NULL) {
+			perror("malloc lower cowfiles");
+			exit(2);
+		}
+
+		for (i=0, p=lowbuf; i < nrlowfiles; i++, p += strlen(p) + 1)
+			strcpy(p, lowfiles[i]);
+	}
+
 	/*
 	** fill structure info for ioctl COWMKPAIR
 	*/
@@ -205,6 +263,12 @@ pairadd (char *rdopath, char *cowpath, char *prefdev)
 	cowpair.rdoflen		= strlen(rdopath);
 	cowpair.cowflen		= strlen(cowpath);
 
+	cowpair.flags		= flags;
+	cowpair.mapunit		= mapunit;
+
+	cowpair.lowfiles	= (unsigned char *)lowbuf;
+	cowpair.lowflen		= lowflen;
+
 	/*
 	** check if optional preferred device is specified
 	*/
@@ -285,6 +349,71 @@ pairdel (char *devpath)
 	}
 }
 
+/*
+** convert a comma-separated list of options to flags for COWMKPAIR
+** (the blocksize for a new cowfile is returned separately and the
+** lower cowfiles are gathered in lowfiles)
+*/
+static unsigned long
+pairflags(char *optlist, unsigned long *mapunit)
+{
+	unsigned long	flags = 0;
+	char		*opt, *end;
+	int		i;
+
+	for (opt = strtok(optlist, ","); opt; opt = strtok(NULL, ",")) {
+		if ( strncmp(opt, "mapunit=", 8) == 0) {
+			*mapunit = strtoul(opt+8, &end, 0);
+
+			if (*end == 'k' || *end == 'K') {
+				*mapunit *= 1024;
+				end++;
+			}
+
+			if (*end || *mapunit < MINMAPUNIT ||
+			    *mapunit > MAXMAPUNIT ||
+			    (*mapunit & (*mapunit-1)) ) {
+				fprintf(stderr, "wrong mapunit: %s "
+				        "(power of 2 from %d upto %d)\n",
+				        opt+8, MINMAPUNIT, MAXMAPUNIT);
+				exit(1);
+			}
+			continue;
+		}
+
+		if ( strncmp(opt, "lower=", 6) == 0) {
+			if (opt[6] == '\0') {
+				fprintf(stderr, "wrong lower cowfile: %s\n",
+									opt);
+				exit(1);
+			}
+
+			if (nrlowfiles == COWMAXLAYERS) {
+				fprintf(stderr, "more than %d lower "
+				        "cowfiles\n", COWMAXLAYERS);
+				exit(1);
+			}
+
+			lowfiles[nrlowfiles++] = opt+6;
+			continue;
+		}
+
+		for (i=0; i < sizeof pairopts / sizeof pairopts[0]; i++) {
+			if ( strcmp(opt, pairopts[i].name) == 0) {
+				flags |= pairopts[i].flag;
+				break;
+			}
+		}
+
+		if (i == sizeof pairopts / sizeof pairopts[0]) {
+			fprintf(stderr, "unknown option: %s\n", opt);
+			exit(1);
+		}
+	}
+
+	return flags;
+}
+
 static void
 prusage(char *prog)
 {
@@ -293,11 +422,27 @@ prusage(char *prog)
 		"\t%s -l                          "
 	        "\tlist active cowdevices\n", prog);
 	fprintf(stderr,
-		"\t%s -a rdofile cowfile [devfile]"
+		"\t%s -a [-o opt,...] rdofile cowfile [devfile]"
 		"\tactivate new cowdevice\n", prog);
 	fprintf(stderr,
 		"\t%s -d devfile                  "
 		"\tdeactivate existing cowdevice\n", prog);
+	fprintf(stderr, "\n\toptions for activation:\n");
+	fprintf(stderr,
+		"\t\taio\tasynchronous I/O on read-only file and cowfile\n"
+		"\t\tjournal\tjournal of bitmap updates (new cowfile only)\n"
+		"\t\tzero\tblocks written with zeroes become holes\n"
+		"\t\tnocache\tno double caching of backing files\n"
+		"\t\tdense\tdense layout, blocks appended "
+		"(new cowfile only)\n"
+		"\t\tcompress\tdense layout, blocks compressed "
+		"(new cowfile only,\n\t\t\tmapunit of at least 16K)\n"
+		"\t\tdedup\tdense layout, identical blocks stored once "
+		"(new cowfile only)\n"
+		"\t\tmapunit=N\tblocksize in bytes or K, power of 2 from "
+		"1K upto 1024K\n\t\t\t(new cowfile only, default 1K)\n"
+		"\t\tlower=F\tread-only cowfile F between rdofile and "
+		"cowfile;\n\t\t\trepeat for a chain, lowest first\n");
 }
 
 static dev_t
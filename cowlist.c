@@ -57,6 +57,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <string.h>
 #include "version.h"
 #include "cowloop.h"
 
@@ -65,7 +66,7 @@ static void prusage(char *);
 int
 main(int argc, char *argv[])
 {
-	long int	fd;
+	long int	fd, conv = 0;
 	struct cowhead	cowhead;
 
 	/*
@@ -98,28 +99,48 @@ main(int argc, char *argv[])
 		exit(1);
 	}
 
+	if ( COWHEAD32(&cowhead) ) {
+		cowconvhead(&cowhead);
+		conv = 1;
+	}
+
 	printf("\nInfo about cowfile %s:\n", argv[1]);
 
 	printf("     state cowfile: %9s",
 				cowhead.flags & COWDIRTY ? "dirty" : "clean");
 	if (cowhead.flags & COWPACKED) printf(" packed");
+	if (cowhead.flags & COWCOMPRESS) printf(" compressed");
+	if (cowhead.flags & COWDEDUP) printf(" deduplicated");
 	printf("\n");
-	printf("    header-version: %9d\n",
-				cowhead.version);
-	printf("       data offset: %9lu\n", cowhead.doffset);
-	printf("           mapunit: %9lu\n",
-				cowhead.mapunit);
-	printf("     bitmap-blocks: %9lu (of %lu bytes)\n",
-				cowhead.mapsize/cowhead.mapunit,
+	printf("    header-version: %9d%s\n",
+				cowhead.version, conv ? " (32-bit cowhead)" : "");
+	printf("       data offset: %9llu\n", cowhead.doffset);
+	printf("           mapunit: %9llu\n",
 				cowhead.mapunit);
-	printf("  cowblocks in use: %9lu (of %lu bytes)\n",
+	if (cowhead.flags & COWDENSE) {
+		printf("   slot map offset: %9llu\n", cowhead.soffset);
+		printf("   slot map blocks: %9llu (of %d bytes)\n",
+				cowhead.ssize/MAPUNIT, MAPUNIT);
+		printf("      slots in cow: %9llu\n", cowhead.nextslot - 1);
+	} else {
+		printf("     bitmap-blocks: %9llu (of %d bytes)\n",
+				cowhead.mapsize/MAPUNIT, MAPUNIT);
+	}
+	printf("  cowblocks in use: %9llu (of %llu bytes)\n",
 				cowhead.cowused, cowhead.mapunit);
-	printf("      size rdofile: %9lu (of %lu bytes)\n",
+	printf("      size rdofile: %9llu (of %llu bytes)\n",
 				cowhead.rdoblocks,
                                 cowhead.mapunit);
+	if (cowhead.flags & COWJOURNAL) {
+		printf("    journal offset: %9llu\n", cowhead.joffset);
+		printf("     journal slots: %9llu (of %d bytes)\n",
+				cowhead.jsize / COWJRECSZ, COWJRECSZ);
+		printf("journal generation: %9llu\n", cowhead.jgen);
+	}
 	return 0;
 }
 
+
 static void
 prusage(char *pname)
 {
@@ -5,17 +5,47 @@
 **
 ** Synopsis:
 **
-**     modprobe cowloop [maxcows=..] [rdofile=..... cowfile=.... [option=r]]
+**     modprobe cowloop [maxcows=..] [nrthreads=..] [qdepth=..] [aiothreads=..]
+**                      [readahead=..]
+**                      [rdofile=..... cowfile=.... [option=rajzndcu] [mapunit=..]]
 **
 ** Definition of number of configured cowdevices:
 **   maxcows=	number of configured cowdevices (default: 16)
 ** (do not confuse this with MAXCOWS: absolute maximum as compiled)
 **
+** Definition of parallelism per cowdevice:
+**   nrthreads=	number of kernel-threads handling requests (default: 4)
+**   qdepth=	maximum number of requests in progress (default: 32)
+**   aiothreads= number of kernel-threads for asynchronous I/O on the
+**		backing files, only started for cowdevices that have been
+**		activated with asynchronous I/O (default: 8)
+**
+** Definition of sequential read-ahead on the read-only file:
+**   readahead=	window in Kb prefetched ahead of a sequential stream of
+**		reads from the read-only file (default: 512, 0: off);
+**		can be modified via /sys/module/cowloop/parameters
+**
 ** One pair of filenames can be supplied during insmod/modprobe to open
 ** the first cowdevice:
 **   rdofile=	read-only file (or filesystem)
 **   cowfile=	storage-space for modified blocks of read-only file(system)
 **   option=r	repair cowfile automatically if it appears to be dirty
+**   option=a	asynchronous I/O on the backing files
+**   option=j	create a new cowfile with a journal of bitmap updates
+**   option=z	blocks written with binary zeroes only become holes in
+**		the cowfile instead of data blocks
+**   option=n	no double caching: pages of the backing files are dropped
+**		from the page cache once they have been transferred
+**   option=d	create a new cowfile with a dense layout: written blocks
+**		are appended to the cowfile (see below)
+**   option=c	create a new cowfile with a dense layout in which the
+**		blocks are compressed (see below); the mapunit must be
+**		at least 16384 bytes
+**   option=u	create a new cowfile with a dense layout in which blocks
+**		with the same contents share a slot (see below)
+**   mapunit=	blocksize of a new cowfile: power of 2 from 1024 upto
+**		1048576 bytes (default: 1024); an existing cowfile keeps
+**		the blocksize it has been created with
 **
 ** Other cowdevices can be activated via the command "cowdev"
 ** whenever the cowloop-driver is loaded.
@@ -27,12 +57,13 @@
 ** used again for the current read-only file. When the cowfile has not been
 ** closed properly during a previous session (i.e. rmmod cowloop), the
 ** cowloop-driver refuses to open it unless the parameter "option=r" is
-** specified.
+** specified. A dirty cowfile with a journal is always accepted, because
+** the bitmap is repaired by replaying the journal.
 **
 ** Layout of cowfile:
 **
 ** 	+-----------------------------+
-**	|       cow head block        |   MAPUNIT bytes
+**	|       cow head block        |   mapunit bytes
 **	|-----------------------------|
 **	|                             |   MAPUNIT bytes
 **	|---                       ---|
@@ -42,9 +73,11 @@
 **	|-----------------------------|
 **	|  gap to align start-offset  |   
 **	|        to 4K multiple       |
+**	|-----------------------------|  <---- start-offset journal (optional)
+**	|  journal of bitmap updates  |   COWJOURNALSZ bytes
 **	|-----------------------------|  <---- start-offset cow blocks
 **	|                             |
-**      |    written cow blocks       |   MAPUNIT bytes
+**      |    written cow blocks       |   mapunit bytes
 **      |          .....              |
 **
 ** 	cowhead block:
@@ -52,10 +85,86 @@
 ** 	    to this cowfile
 **
 ** 	used-block bitmap:
-** 	  - contains one bit per block with a size of MAPUNIT bytes
+** 	  - contains one bit per block with a size of mapunit bytes
+** 	    (version 1: always MAPUNIT, version 2: as in cowhead)
 ** 	  - bit-value '1' = block has been written on cow
 ** 	              '0' = block unused on cow
 ** 	  - total bitmap rounded to multiples of MAPUNIT
+** 	  - a discarded block is marked '1' while its data area in the
+** 	    cowfile is a hole, so it reads as binary zeroes (the same
+** 	    holds for parts of a block that have been copied up from
+** 	    binary zeroes in the rdofile)
+**
+** 	journal (only with cowhead flag COWJOURNAL):
+** 	  - slots of COWJRECSZ bytes, each containing the extents of
+** 	    blocks written for the first time by one write
+** 	  - records are only valid for the journal generation in the
+** 	    cowhead, which is incremented after every bitmap flush
+**
+** Layout of a dense cowfile (version 3, cowhead flag COWDENSE):
+**
+** 	+-----------------------------+
+**	|       cow head block        |   mapunit bytes
+**	|-----------------------------|
+**	|        slot map             |   4 bytes per block, rounded to
+**	|                             |   MAPUNIT bytes
+**	|-----------------------------|
+**	|  gap to align start-offset  |
+**	|        to 4K multiple       |
+**	|-----------------------------|  <---- start-offset slots
+**	|  slot 1, slot 2, ...        |   mapunit bytes per slot
+**
+** 	slot map:
+** 	  - contains the number of the slot holding each block;
+** 	    COWNOSLOT: block unused on cow, COWZEROSLOT: block of
+** 	    binary zeroes without slot (e.g. discarded)
+** 	  - the bitmap in memory is derived from the slot map
+** 	  - slots are allocated in sequence, so new blocks are appended
+** 	    to the cowfile; a block that is overwritten entirely gets a
+** 	    new slot as well (while not too many slots are pending)
+** 	  - the old slot of such block is freed once the slot map has
+** 	    been flushed and synced (until then the slot map in the
+** 	    cowfile might still refer to it); free slots are reused
+** 	    before the cowfile grows
+** 	  - the slots are synced before the slot map is flushed, so after
+** 	    a crash the slot map is valid as flushed last: blocks written
+** 	    since are lost, so no recovery is needed
+**
+** 	compressed blocks (version 4, cowhead flag COWCOMPRESS as well):
+** 	  - the slot map contains the slot number and the length of the
+** 	    compressed data for each block (8 bytes per block); a block
+** 	    that does not get smaller is stored uncompressed (length 0)
+** 	  - only the compressed data is written to (and read from) the
+** 	    slot; the remainder of a new slot stays a hole
+** 	  - the mapunit is at least 16K, so that a slot spans several
+** 	    blocks of the filesystem: compression only saves space (and
+** 	    bandwidth) in whole filesystem blocks; a block that does not
+** 	    save at least one of them is stored uncompressed
+** 	  - a written block always gets a new slot
+**
+** 	deduplicated blocks (version 5, cowhead flag COWDEDUP as well):
+** 	  - a block that is written with the same contents as a block
+** 	    written before refers to the slot of that block, so several
+** 	    entries in the slot map might contain the same slot
+** 	  - a slot is freed when the last block referring to it gets
+** 	    another slot; the number of references is counted in memory
+** 	  - a written block always gets a new slot (or a shared one)
+**
+** Stacked cowfiles:
+**
+**	A cowdevice activated via the command "cowdev" might have a chain of
+**	read-only cowfiles (lower cowfiles) between the rdofile and the
+**	cowfile, e.g. rdofile <- team layer <- user layer <- cowfile:
+**	  - a lower cowfile must have the bitmap layout, must be clean and
+**	    must be related to the rdofile; all lower cowfiles have the
+**	    same mapunit, which is taken by a new cowfile as well
+**	  - when the cowdevice is activated, the bitmaps of the lower
+**	    cowfiles are merged into one index in memory with the layer that
+**	    owns each block (one byte per block; index chunks of blocks that
+**	    all reside in the rdofile are not allocated), so a block that is
+**	    not in the cowfile is read from the proper layer directly
+**	  - the lower cowfiles are never modified: a block is copied up
+**	    into the cowfile from the layer that owns it
 **
 ** ============================================================================
 ** Author:             Gerlof Langeveld - AT Computing (March 2003)
@@ -105,18 +214,40 @@
 **   heavy load. Other experiments using the `make_request' interface also
 **   resulted in unpredictable system hangups (with proper use of spinlocks).
 **
-**   To overcome these problems, the cowloop-driver starts a kernel-thread
-**   for every active cowdevice.
+**   To overcome these problems, the cowloop-driver starts a set of
+**   kernel-threads for every active cowdevice (module parameter nrthreads).
 **   All read- and write-request on the read-only file and copy-on-write file
-**   are handled in the context of that thread.
-**   A scheme has been designed to wakeup the kernel-thread as
-**   soon as I/O-requests are available in the request-queue; this thread
-**   handles the requests one-by-one by calling the proper read- or
-**   write-function related to the open read-only file or copy-on-write file.
-**   When all pending requests have been handled, the kernel-thread goes
+**   are handled in the context of those threads.
+**   The request-function moves up to 'qdepth' requests from the
+**   request-queue to a private list and wakes up one of the kernel-threads;
+**   every thread handles one request at a time by calling the proper read-
+**   or write-function related to the open read-only file or copy-on-write
+**   file, so several requests per cowdevice can be in progress concurrently.
+**   When all pending requests have been handled, the kernel-threads go
 **   back to sleep-state.
+**   Writes that might modify the bitmap only exclude each other when they
+**   concern the same blocks (range locks); reads and writes of blocks that
+**   already reside in the cowfile are not serialized at all. Copy-up
+**   buffers are taken from a memory pool per cowdevice, which keeps a
+**   reserve to guarantee progress when memory is short.
+**   When the read-only file is a block device, reads of blocks that have
+**   never been modified are not queued at all: the make_request function
+**   of the cowdevice remaps such a bio to the block device below, which
+**   completes it without any involvement of the kernel-threads.
+**   When a cowdevice is activated with asynchronous I/O, a request that
+**   can be served by one backing file is not handled by the kernel-thread
+**   itself: the backing I/O is passed to a separate set of I/O-threads
+**   with a completion function that ends the request, so the kernel-thread
+**   can proceed with the next request immediately and many backing I/Os
+**   on both the read-only file and the cowfile can be in progress.
 **   This approach requires some additional context-switches; however the
 **   performance loss during heavy I/O is less than 3%.
+**   A cowfile with a journal gets a record appended for every write that
+**   sets new bits in the bitmap, before the write is acknowledged. When
+**   the journal is full, the modified bitmap chunks are flushed and the
+**   journal starts again with a new generation. A dirty cowfile is then
+**   recovered by replaying the journal instead of reading all data
+**   blocks of the cowfile.
 **
 ** -------------------------------------------------------------------------*/
 /* The following is the cowloop package version number. It must be
@@ -264,8 +395,14 @@ char revision[] = "$Revision: 3.1 $"; /* cowlo_init_module() has
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/hdreg.h>
+#include <linux/bitops.h>
+#include <linux/mempool.h>
+#include <linux/rwsem.h>
 #include <linux/genhd.h>
 #include <linux/statfs.h>
+#include <linux/falloc.h>
+#include <linux/crypto.h>
+#include <linux/jhash.h>
 
 #include "cowloop.h"
 
@@ -276,11 +413,24 @@ MODULE_DESCRIPTION("Copy-on-write loop driver");
 MODULE_PARM_DESC(maxcows, " Number of configured cowdevices (default 16)");
 MODULE_PARM_DESC(rdofile, " Read-only file for /dev/cow/0");
 MODULE_PARM_DESC(cowfile, " Cowfile for /dev/cow/0");
-MODULE_PARM_DESC(option, "  Repair cowfile if inconsistent: option=r");
+MODULE_PARM_DESC(option, "  Repair cowfile (r), asynchronous I/O (a), new cowfile with journal (j), zero blocks as holes (z), no double caching (n), new dense cowfile (d), compressed (c), deduplicated (u): option=rajzndcu");
+MODULE_PARM_DESC(nrthreads, " Number of kernel-threads per cowdevice (default 4)");
+MODULE_PARM_DESC(qdepth, " Maximum requests in progress per cowdevice (default 32)");
+MODULE_PARM_DESC(aiothreads, " Number of asynchronous I/O-threads per cowdevice (default 8)");
+MODULE_PARM_DESC(readahead, " Read-ahead window in Kb on the read-only file (default 512)");
+MODULE_PARM_DESC(mapunit, "   Blocksize of a new cowfile for /dev/cow/0 (default 1024)");
 
 #define DEVICE_NAME	"cow"
 
 #define	DFLCOWS		16		/* default cowloop devices	*/
+#define	DFLTHREADS	4		/* default threads per cowdevice*/
+#define	MAXTHREADS	64		/* maximum threads per cowdevice*/
+#define	DFLQDEPTH	32		/* default requests in progress	*/
+#define	MAXQDEPTH	1024		/* maximum requests in progress	*/
+#define	DFLAIOTHREADS	8		/* default async I/O-threads	*/
+#define	MAXAIOTHREADS	64		/* maximum async I/O-threads	*/
+#define	DFLREADAHEAD	512		/* default read-ahead (Kb)	*/
+#define	MAXREADAHEAD	16384		/* maximum read-ahead (Kb)	*/
 
 static int maxcows = DFLCOWS;
 module_param(maxcows, int, 0);
@@ -290,11 +440,21 @@ static char *cowfile = "";
 module_param(cowfile, charp, 0);
 static char *option = "";
 module_param(option, charp, 0);
+static int nrthreads = DFLTHREADS;
+module_param(nrthreads, int, 0);
+static int qdepth = DFLQDEPTH;
+module_param(qdepth, int, 0);
+static int aiothreads = DFLAIOTHREADS;
+module_param(aiothreads, int, 0);
+static int readahead = DFLREADAHEAD;
+module_param(readahead, int, 0644);
+static int dflmapunit = MAPUNIT;
+module_param_named(mapunit, dflmapunit, int, 0);
 
 /*
 ** per cowdevice several bitmap chunks are allowed of MAPCHUNKSZ each
 **
-** each bitmap chunk can describe MAPCHUNKSZ * 8 * MAPUNIT bytes of data
+** each bitmap chunk can describe MAPCHUNKSZ * 8 * mapunit bytes of data
 ** suppose:
 **	MAPCHUNKSZ 4096 and MAPUNIT 1024 --> 4096 * 8 * 1024 = 32 Mb per chunk
 */
@@ -304,16 +464,141 @@ module_param(option, charp, 0);
 #define SPCDFLINTVL	16	/* once every SPCDFLINTVL writes to cowfile, */
 				/* available space in filesystem is checked  */
 
-#define	CALCMAP(x)	((x)/(MAPCHUNKSZ*8))
-#define	CALCBYTE(x)	(((x)%(MAPCHUNKSZ*8))>>3)
-#define	CALCBIT(x)	((x)&7)
+#define	MAPCHUNKBITS	(MAPCHUNKSZ*8)	/* #bits per bitmap chunk    */
+#define	MAPCHUNKSHIFT	15		/* log2 of MAPCHUNKBITS      */
+
+/*
+** block numbers are 64-bit (unsigned long long), so only shifts and
+** masks are used to avoid 64-bit divisions on 32-bit systems
+*/
+#define	CALCMAP(x)	((unsigned long)((x) >> MAPCHUNKSHIFT))
+#define	CALCBYTE(x)	(((unsigned long)(x) & (MAPCHUNKBITS-1)) >> 3)
+#define	CALCBIT(x)	((unsigned long)(x) & 7)
+
+/*
+** the slot map of a dense cowfile is kept in memory in chunks as well,
+** one chunk (of unsigned ints) per bitmap chunk; a compressed cowfile
+** has two unsigned ints per block (slotshift 1): slot and length
+*/
+#define	SLOTCHUNKN(d,m)	((unsigned long)((m) < (d)->mapcount-1 ? MAPCHUNKBITS :\
+			 (d)->numblocks - (unsigned long long)(m)*MAPCHUNKBITS))
+#define	SLOTCHUNKSZ(d,m) ((SLOTCHUNKN(d,m) << (d)->slotshift) * \
+			 sizeof(unsigned int))
+#define	SLOTCHUNKOFF(d,m) ((loff_t)(d)->cowhead->soffset + \
+			 ((loff_t)(m) * MAPCHUNKBITS << (d)->slotshift) * \
+			 sizeof(unsigned int))
+#define	SLOTP(d,x)	(*((d)->slotcache + CALCMAP(x)) + \
+			 (((unsigned long)(x) & (MAPCHUNKBITS-1)) << (d)->slotshift))
+#define	SLOTLEN(d,x)	(SLOTP(d,x) + 1)
+#define	SLOTOFF(d,s)	((loff_t)(d)->cowhead->doffset + \
+			 ((loff_t)((s)-1) << (d)->mushift))
+#define	SLOTREAL(s)	((s) != COWNOSLOT && (s) != COWZEROSLOT)
+
+/*
+** slot numbers must stay below COWZEROSLOT, also with the pending slots
+** (see cowlo_slotinit)
+*/
+#define	COWMAXDENSE	0x70000000ULL	/* maximum blocks of dense cowfile */
+#define	COWSLOTSPARE	4096		/* slots for writes in progress    */
+
+/*
+** compression of the blocks of a compressed cowfile
+*/
+#define	COWCOMPALG	"lzo"
+#define	COWCOMPUNIT	(16*1024)	/* minimum mapunit to compress     */
+#define	COWCOMPDISK(d,l) (((l) + (d)->blksize - 1) / (d)->blksize * \
+			 (d)->blksize)	/* filesystem space of data in slot */
+#define	COWCOMPBUFSZ(d)	((d)->mapunit + (d)->mapunit/16 + 67) /* worst case */
+
+/*
+** blocks handled one at a time (compressed and/or deduplicated)
+*/
+#define	COWBLOCKIO	(COWCOMPRESS|COWDEDUP)
+#define	COWDEDUPMAX	(1<<20)		/* maximum entries of dedup index  */
+
+/*
+** the bitmap has little-endian bit-order (bit 0 of byte 0 describes
+** block 0), so it can be searched a machine word at a time with the
+** little-endian bit-search functions
+*/
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,39))
+#define	cowlo_find_next_bit(a, s, o)		find_next_bit_le(a, s, o)
+#define	cowlo_find_next_zero_bit(a, s, o)	find_next_zero_bit_le(a, s, o)
+#else
+#define	cowlo_find_next_bit(a, s, o)		ext2_find_next_bit(a, s, o)
+#define	cowlo_find_next_zero_bit(a, s, o)	ext2_find_next_zero_bit(a, s, o)
+#endif
 
 #define ALLCOW		1
 #define ALLRDO		2
 #define MIXEDUP		3
 
+#define	PAIRFLAGS	(PAIRAIO|PAIRJOURNAL|PAIRZERO|PAIRNOCACHE|PAIRDENSE|\
+			 PAIRCOMPRESS|PAIRDEDUP)
+
+#define	COWASYNC	2	/* request will be ended by I/O-completion   */
+
+/*
+** every request is handled as a whole by one kernel-thread, so the
+** size of a request and the number of segments is limited
+*/
+#define	COWMAXSECT	2048	/* maximum sectors per request (1 Mb)        */
+#define	COWMAXSEGS	256	/* maximum segments per request              */
+
+/*
+** only the first and the last block of a request might have to be
+** copied up, so a copy-up buffer needs room for two blocks
+*/
+#define	COWBUFSZ(d)	(2*(d)->mapunit)
+
+/*
+** the cowhead only occupies the first MAPUNIT bytes of its block
+*/
+#define	COWHEADSZ	MAPUNIT
+
+/*
+** newly written extents of one write are collected on the stack and
+** logged in the journal in batches of (at most) this many extents
+*/
+#define	COWJBATCH	8
+
+/*
+** recovery of a dirty cowfile only reads the data extents of the
+** cowfile (as reported by the filesystem) in large reads
+*/
+#define	COWRECOVSZ	(1024*1024)	/* bytes per read during recovery  */
+#define	COWFIEXTS	32		/* extents asked per fiemap call   */
+
+/*
+** a discard request is handled as a whole as well (without data)
+*/
+#define	COWMAXDISCARD	(1024*1024*1024) /* maximum bytes per discard      */
+
+/*
+** the cowdevice has a volatile write cache (the page cache of the
+** cowfile): requests to flush that cache have changed over time
+*/
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36))
+#define	COWFLUSHREQ(r)	((r)->cmd_flags & REQ_FLUSH)
+#else
+#define	COWFLUSHREQ(r)	((r)->cmd_type == REQ_TYPE_LINUX_BLOCK && \
+			 (r)->cmd[0]   == REQ_LB_OP_FLUSH)
+#endif
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37))
+#define	COWFUAREQ(r)	((r)->cmd_flags & REQ_FUA)
+#else
+#define	COWFUAREQ(r)	0	/* barrier is followed by a flush request */
+#endif
+
 static char	allzeroes[MAPUNIT];
 
+/*
+** bitmap chunk without any bit set, shared by all cowdevices
+** (never modified)
+*/
+static unsigned long	zerochunk[MAPCHUNKSZ / sizeof(unsigned long)];
+
 /*
 ** administration per cowdevice (pair of cowfile/rdofile)
 */
@@ -326,6 +611,124 @@ static char	allzeroes[MAPUNIT];
 
 #define	COWCOWOPEN	(COWRWCOWOPEN|COWRDCOWOPEN)
 
+struct cowloop_device;
+
+/*
+** range of blocks locked by a write that might modify the bitmap
+*/
+struct cowlo_range
+{
+	struct list_head	list;		/* chain of locked ranges    */
+	unsigned long long	first;		/* first block of range      */
+	unsigned long long	last;		/* block following range     */
+};
+
+/*
+** administration per kernel-thread of a cowdevice
+*/
+struct cowlo_worker
+{
+	struct cowloop_device	*cowdev;	/* cowdevice served          */
+	int			index;		/* sequence number of thread */
+	int			pid;		/* pid==0: thread not started*/
+
+	struct iovec	iov[COWMAXSEGS];	/* segments current request  */
+	struct iovec	tmp[COWMAXSEGS+2];	/* scratch area for subrange */
+	int		nrio;			/* backing I/Os of request   */
+};
+
+/*
+** description of the data area of a request: one entry per segment
+** of all bios in the request (adjacent segments combined), ordered
+** like the device offsets they relate to
+*/
+struct cowlo_vec
+{
+	struct iovec	*iov;		/* segments of the data area         */
+	int		nriov;		/* number of segments                */
+	struct iovec	*tmp;		/* scratch area to describe subrange */
+					/* (two entries more than iov)       */
+	int		nrio;		/* number of backing I/Os issued     */
+};
+
+/*
+** compression context: a thread compresses and decompresses one block
+** at a time with its own transform and buffers
+*/
+struct cowlo_comp
+{
+	struct crypto_comp	*tfm;		/* transform of COWCOMPALG   */
+	char			*blockbuf;	/* uncompressed block        */
+	char			*compbuf;	/* compressed block          */
+	char			*dedupbuf;	/* slot contents to compare  */
+	struct cowlo_comp	*next;		/* next free context         */
+};
+
+/*
+** entry of the dedup index: slot containing a block with a hash value
+*/
+struct cowlo_dedup
+{
+	u32		hash;		/* hash value of block contents      */
+	u32		slot;		/* slot (COWNOSLOT: unused entry)    */
+	u32		clen;		/* length of data in slot            */
+};
+
+/*
+** lower cowfile of a cowdevice (opened read-only)
+*/
+struct cowlo_layer
+{
+	struct file	*fp;		/* open file pointer                 */
+	char		*name;		/* pathname of lower cowfile         */
+	unsigned long	mapunit;	/* blocksize of lower cowfile        */
+	loff_t		doffset;	/* start-offset datablocks           */
+};
+
+/*
+** administration per asynchronous I/O-thread of a cowdevice
+*/
+struct cowlo_iothread
+{
+	struct cowloop_device	*cowdev;	/* cowdevice served          */
+	int			index;		/* sequence number of thread */
+	int			pid;		/* pid==0: thread not started*/
+};
+
+/*
+** asynchronous I/O on one of the backing files: the I/O-function is
+** called in the context of an I/O-thread, after which the completion
+** function is called with the return-value of the I/O-function
+*/
+struct cowlo_aio
+{
+	struct list_head	list;		/* chain of pending I/Os     */
+	long int		(*func)(struct cowloop_device *,
+				   const struct iovec *, int, int, loff_t);
+	const struct iovec	*iov;		/* data area                 */
+	int			nriov;		/* number of segments        */
+	int			len;		/* total length (bytes)      */
+	loff_t			offset;		/* offset on cowdevice       */
+	void			(*done)(struct cowlo_aio *, long int);
+	void			*private;	/* for completion function   */
+};
+
+/*
+** request handled by asynchronous I/O: the request is ended as soon
+** as all backing I/Os have completed; the segments of the request are
+** copied (directly behind the backing I/Os) because the kernel-thread
+** reuses its own vector immediately
+*/
+struct cowlo_areq
+{
+	struct request		*req;		/* request to be ended       */
+	struct cowloop_device	*cowdev;	/* cowdevice of request      */
+	atomic_t		pending;	/* backing I/Os in progress  */
+	int			error;		/* error to end request with */
+	int			nraio;		/* number of backing I/Os    */
+	struct cowlo_aio	aio[0];		/* backing I/Os              */
+};
+
 struct cowloop_device
 {
 	/*
@@ -333,6 +736,7 @@ struct cowloop_device
 	*/
 	int		state;			/* bit-values (see above)    */
 	int		opencnt;		/* # opens for cowdevice     */
+	int		pairflags;		/* options (see cowloop.h)   */
 
         /*
 	** open file pointers
@@ -350,33 +754,126 @@ struct cowloop_device
 	/*
 	** administration about read-only file
 	*/
-	unsigned int	     numblocks;	/* # blocks input file in MAPUNIT    */
+	unsigned long long   rdosize;	/* size of input file (bytes)        */
+	unsigned long long   numblocks;	/* # blocks input file in mapunit    */
 	unsigned int	     blocksz;   /* minimum unit to access this dev   */
 	unsigned long	     fingerprint; /* fingerprint of current rdofile  */
 	struct block_device  *belowdev;	/* block device below us             */
 	struct gendisk       *belowgd;  /* gendisk for blk dev below us      */
 	struct request_queue *belowq;	/* req. queue of blk dev below us    */
+	make_request_fn	     *mkrequest; /* make_request: queued requests    */
+
+	/*
+	** read-ahead for a sequential stream of reads from read-only file
+	*/
+	spinlock_t	ralock;		/* protects read-ahead administration*/
+	loff_t		ranext;		/* offset following last rdo read    */
+	loff_t		rastart;	/* start of area prefetched          */
+	loff_t		raend;		/* end   of area prefetched          */
+
+	/*
+	** read-only cowfiles between read-only file and cowfile (if any)
+	*/
+	struct cowlo_layer *layers;	/* lower cowfiles (lowest first)     */
+	int		nrlayers;	/* number of lower cowfiles opened   */
+	char		*lownames;	/* buffer with their pathnames       */
+	unsigned char	**layermap;	/* owning layer per block in chunks  */
+					/* of MAPCHUNKBITS (0: rdofile, n:   */
+					/* layers[n-1]; NULL: all rdofile)   */
+	int		layerchunks;	/* number of chunk pointers          */
+	unsigned long	layerbytes;	/* allocated chunks (bytes)          */
 
 	/*
 	** bitmap administration to register which blocks are modified
 	*/
+	unsigned long	mapunit;	/* blocksize for bit in bitmap       */
+	int		mushift;	/* bitshift  for bit in bitmap       */
+	unsigned long	mumask;		/* bitmask   for bit in bitmap       */
 	long int	mapsize;	/* total size of bitmap (bytes)      */
 	long int	mapremain;	/* remaining bytes in last bitmap    */
 	int		mapcount;       /* number of bitmaps in use          */
 	char 		**mapcache;	/* area with pointers to bitmaps     */
+					/* (NULL: not yet read from cowfile) */
+	struct semaphore mapsem;	/* serializes loading of bitmaps     */
+	unsigned long	*mapdirty;	/* one bit per bitmap chunk modified */
+					/* since last flush to cowfile       */
 
-	char		*iobuf;		/* databuffer of MAPUNIT bytes       */
+	mempool_t	*bufpool;	/* copy-up buffers of COWBUFSZ bytes */
+	spinlock_t	maplock;	/* protects updates of bitmap bytes  */
 	struct cowhead	*cowhead;	/* buffer containing cowhead         */
 
 	/*
-	** administration for interface with the kernel-thread
+	** administration of the slots of a dense cowfile (if any)
+	*/
+	unsigned int	**slotcache;	/* slot map chunks (as mapcache)     */
+	spinlock_t	slotlock;	/* protects allocation of slots      */
+	unsigned long	*slotused;	/* one bit per slot: not free        */
+	unsigned long	*slotpend;	/* slots freed since last flush      */
+	unsigned long	*slotstage;	/* slots freed before last flush     */
+	unsigned long	pendlo, pendhi;	/* range of bits set in slotpend     */
+	unsigned long	stagelo, stagehi; /* range of bits set in slotstage  */
+	unsigned long	maxslots;	/* number of bits per slot bitmap    */
+	unsigned long	nextslot;	/* first slot that was never used    */
+	unsigned long	slotcursor;	/* free slot to be tried first       */
+	unsigned long	freeslots;	/* free slots below nextslot         */
+	unsigned long	pendslots;	/* slots pending and staged          */
+	int		slotshift;	/* log2 of unsigned ints per block   */
+	unsigned int	*slotrefs;	/* references per slot (dedup only)  */
+	u32		*slothash;	/* hash of contents per slot (dedup) */
+	struct cowlo_dedup *deduptab;	/* dedup index                       */
+	unsigned long	dedupsize;	/* number of entries (power of 2)    */
+
+	/*
+	** compression contexts for a compressed cowfile (if any)
+	*/
+	struct cowlo_comp *comp;	/* all contexts                      */
+	int		nrcomp;		/* number of contexts                */
+	struct cowlo_comp *compfree;	/* list of free contexts             */
+	spinlock_t	complock;	/* protects list of free contexts    */
+	struct semaphore compsem;	/* counts free contexts              */
+	int		convhead;	/* cowhead converted from 32-bit     */
+
+	/*
+	** administration of the journal of bitmap updates (if any)
+	*/
+	struct semaphore jsem;		/* serializes writes to the journal  */
+	struct cowjrec	*jrec;		/* buffer for one journal record     */
+	unsigned long	jslot;		/* next free slot in journal         */
+	unsigned long	jslots;		/* total number of slots in journal  */
+
+	/*
+	** administration for interface with the kernel-threads
 	*/
-	int		pid;		/* pid==0: no thread available       */
-	struct request	*req;		/* request to be handled now         */
-	wait_queue_head_t waitq;	/* wait-Q: thread waits for work     */
+	struct cowlo_worker *workers;	/* one entry per kernel-thread       */
+	int		nrworkers;	/* number of entries in workers      */
+	int		nrrunning;	/* number of threads still running   */
+	struct list_head reqlist;	/* requests fetched, not yet handled */
+	int		inflight;	/* requests fetched, not yet ended   */
+	int		qdepth;		/* maximum value of inflight         */
+	wait_queue_head_t waitq;	/* wait-Q: threads wait for work     */
 	char		closedown;	/* boolean: thread exit required     */
-	char		qfilled;	/* boolean: I/O request pending      */
-	char		iobusy;		/* boolean: req under treatment      */
+	struct rw_semaphore cowsem;	/* read: bitmap modified, write: sync*/
+	struct list_head rangelist;	/* ranges locked by writes           */
+	spinlock_t	rangelock;	/* protects rangelist                */
+	wait_queue_head_t rangewaitq;	/* wait-Q: writes wait for range     */
+
+	/*
+	** administration of commits of the cowfile for flush requests
+	*/
+	struct semaphore commitsem;	/* serializes commits                */
+	atomic_t	commitreqs;	/* commits asked for so far          */
+	unsigned int	commitdone;	/* commitreqs served by last commit  */
+	unsigned int	commitok;	/* idem, by last successful commit   */
+
+	/*
+	** administration for asynchronous I/O on the backing files
+	*/
+	struct cowlo_iothread *iothreads; /* one entry per I/O-thread        */
+	int		nriothreads;	/* number of entries in iothreads    */
+	int		nriorunning;	/* number of I/O-threads running     */
+	struct list_head aiolist;	/* backing I/Os not yet started      */
+	spinlock_t	aiolock;	/* protects aiolist                  */
+	wait_queue_head_t aiowaitq;	/* wait-Q: I/O-threads wait for work */
 
 	/*
 	** administration to keep track of free space in cowfile filesystem
@@ -392,9 +889,35 @@ struct cowloop_device
 	** statistical counters
 	*/
 	unsigned long	rdoreads;	/* number of  read-actions rdo       */
+	atomic_t	rdopassed;	/* number of  reads passed to rdodev */
+	unsigned long	rahits;		/* rdo reads within prefetched area  */
+	unsigned long	ramisses;	/* rdo reads outside prefetched area */
+	unsigned long	lowreads;	/* number of read-actions lower cows */
 	unsigned long	cowreads;	/* number of  read-actions cow       */
 	unsigned long	cowwrites;	/* number of write-actions           */
-	unsigned long	nrcowblocks;	/* number of blocks in use on cow    */
+	unsigned long long nrcowblocks;	/* number of blocks in use on cow    */
+	unsigned long	nrrequests;	/* number of requests handled        */
+	unsigned long	nrbackios;	/* backing I/Os for these requests   */
+	unsigned long	maxbackios;	/* maximum backing I/Os per request  */
+	unsigned long	nrsyncs;	/* number of bitmap flushes          */
+	unsigned long	maploads;	/* number of bitmap chunks read      */
+	unsigned long	mapbytes;	/* private bitmap chunks (bytes)     */
+	unsigned long	syncbytes;	/* bytes written by last flush       */
+	unsigned long	jrecords;	/* number of journal records written */
+	unsigned long	jcheckpoints;	/* number of flushes for full journal*/
+	unsigned long	discards;	/* number of discard requests        */
+	unsigned long long discardblocks; /* number of blocks discarded      */
+	unsigned long	zerowrites;	/* writes of zeroes turned into holes*/
+	unsigned long	flushes;	/* number of flushes and FUA writes  */
+	unsigned long	commits;	/* number of fsyncs of the cowfile   */
+	unsigned long long zeroblocks;	/* number of blocks of these writes  */
+	unsigned long	sparsecopies;	/* copy-ups of zeroes left as holes  */
+	unsigned long	compwrites;	/* blocks written compressed         */
+	unsigned long long compsaved;	/* bytes saved by compression        */
+	unsigned long	deduplookups;	/* blocks looked up in dedup index   */
+	unsigned long	deduphits;	/* blocks found in dedup index       */
+	unsigned long long dedupsaved;	/* bytes saved by deduplication      */
+	char		nopunch;	/* boolean: no holes in cowfile fs   */
 };
 
 static struct cowloop_device	**cowdevall;	/* ptr to ptrs to all cowdevices */
@@ -411,16 +934,101 @@ struct proc_dir_entry	*cowlo_procdir;
 /*
 ** function prototypes
 */
-static long int cowlo_do_request (struct request *req);
+static long int cowlo_do_request (struct cowlo_worker *, struct request *);
+static void	cowlo_endrequest (struct cowloop_device *, struct request *,
+								int, int);
 static void	cowlo_sync       (void);
+static int	cowlo_syncdev    (struct cowloop_device *);
+static int	cowlo_commit     (struct cowloop_device *);
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,36))
+static void	cowlo_prepflush  (struct request_queue *, struct request *);
+#endif
+static long int cowlo_flushmap   (struct cowloop_device *);
+static int	cowlo_fsync      (struct cowloop_device *);
+static void	cowlo_journal    (struct cowloop_device *,
+					struct cowjext *, int);
 static int	cowlo_checkio    (struct cowloop_device *,         int, loff_t);
-static int	cowlo_readmix    (struct cowloop_device *, void *, int, loff_t);
-static int	cowlo_writemix   (struct cowloop_device *, void *, int, loff_t);
+static char	*cowlo_mapchunk  (struct cowloop_device *, unsigned long, int);
+static int	cowlo_loadmap    (struct cowloop_device *,
+				  unsigned long long, unsigned long long, int);
+static int	cowlo_maploaded  (struct cowloop_device *,
+				  unsigned long long, unsigned long long);
+static unsigned long long cowlo_mapextent(struct cowloop_device *,
+				  unsigned long long, unsigned long long, int *);
+static int	cowlo_iszero     (const char *, unsigned long);
+static int	cowlo_iovslice   (struct cowlo_vec *, unsigned long,
+					unsigned long, struct iovec *);
+static int	cowlo_discard    (struct cowloop_device *, unsigned long, loff_t);
+static int	cowlo_zerorange  (struct cowloop_device *,
+				  unsigned long long, unsigned long long);
+static int	cowlo_slotinit   (struct cowloop_device *);
+static int	cowlo_slotchunk  (struct cowloop_device *, unsigned long,
+								char *, int);
+static unsigned long cowlo_slotalloc(struct cowloop_device *, int);
+static void	cowlo_slotfree   (struct cowloop_device *, unsigned long, int);
+static void	cowlo_slotstage  (struct cowloop_device *);
+static void	cowlo_slotrelease(struct cowloop_device *);
+static void	cowlo_slotzero   (struct cowloop_device *,
+				  unsigned long long, unsigned long long);
+static long int cowlo_slotio     (struct cowloop_device *,
+			const struct iovec *, int, int, loff_t, int);
+static int	cowlo_compinit   (struct cowloop_device *);
+static struct cowlo_comp *cowlo_compget(struct cowloop_device *);
+static void	cowlo_compput    (struct cowloop_device *, struct cowlo_comp *);
+static int	cowlo_compread   (struct cowloop_device *, struct cowlo_comp *,
+							unsigned long long);
+static long int cowlo_compio     (struct cowloop_device *,
+			const struct iovec *, int, int, loff_t, int);
+static void	cowlo_slotreclaim(struct cowloop_device *);
+static int	cowlo_dedupinit  (struct cowloop_device *);
+static unsigned long cowlo_dedupfind(struct cowloop_device *,
+			struct cowlo_comp *, u32, const char *,
+			unsigned int, unsigned int);
+static void	cowlo_dedupadd   (struct cowloop_device *, u32,
+					unsigned long, unsigned int);
+static void	cowlo_iovput     (const struct iovec *, int, unsigned long,
+					const void *, unsigned long);
+static int	cowlo_slotclear  (struct cowloop_device *, unsigned long);
+static unsigned long cowlo_slotget(struct cowloop_device *,
+						unsigned long long);
+static unsigned long cowlo_slottarget(struct cowloop_device *,
+					unsigned long long, int, loff_t, int);
+static void	cowlo_iovclear   (const struct iovec *, int, unsigned long,
+							unsigned long);
+static int	cowlo_punchcow   (struct cowloop_device *,
+				  unsigned long long, unsigned long long);
+static int	cowlo_markzero   (struct cowloop_device *,
+				  unsigned long long, unsigned long long);
+static void	cowlo_lockrange  (struct cowloop_device *, struct cowlo_range *,
+				  unsigned long long, unsigned long long);
+static void	cowlo_unlockrange(struct cowloop_device *, struct cowlo_range *);
+static int	cowlo_readmix    (struct cowloop_device *, struct cowlo_vec *,
+								int, loff_t);
+static int	cowlo_writemix   (struct cowloop_device *, struct cowlo_vec *,
+								int, loff_t);
 static long int cowlo_readrdo    (struct cowloop_device *, void *, int, loff_t);
+static void	cowlo_readahead  (struct cowloop_device *, int, loff_t);
+static void	cowlo_dropcache  (struct cowloop_device *, struct file *,
+						int, loff_t, int);
 static long int cowlo_readcow    (struct cowloop_device *, void *, int, loff_t);
 static long int cowlo_readcowraw (struct cowloop_device *, void *, int, loff_t);
 static long int cowlo_writecow   (struct cowloop_device *, void *, int, loff_t);
 static long int cowlo_writecowraw(struct cowloop_device *, void *, int, loff_t);
+static long int cowlo_readrdov   (struct cowloop_device *,
+				  const struct iovec *, int, int, loff_t);
+static long int cowlo_readlayerv (struct cowloop_device *,
+				  const struct iovec *, int, int, loff_t);
+static long int cowlo_readlayer  (struct file *, void *, int, loff_t);
+static unsigned long long cowlo_layerextent(struct cowloop_device *,
+				unsigned long long, unsigned long long, int *);
+static long int cowlo_readcowv   (struct cowloop_device *,
+				  const struct iovec *, int, int, loff_t);
+static long int cowlo_readcowrawv(struct cowloop_device *,
+				  const struct iovec *, int, int, loff_t);
+static long int cowlo_writecowv  (struct cowloop_device *,
+				  const struct iovec *, int, int, loff_t);
+static long int cowlo_writecowrawv(struct cowloop_device *,
+				  const struct iovec *, int, int, loff_t);
 
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,28))
 static int      cowlo_ioctl      (struct block_device *, fmode_t,
@@ -434,12 +1042,22 @@ static int	cowlo_makepair    (struct cowpair __user *);
 static int	cowlo_removepair  (unsigned long  __user *);
 static int	cowlo_watch       (struct cowpair __user *);
 static int	cowlo_cowctl      (unsigned long  __user *, int);
-static int	cowlo_openpair    (char *, char *, int, int);
+static int	cowlo_openpair    (char *, char *, int, int, int,
+					unsigned long, char *, unsigned long);
 static int 	cowlo_closepair   (struct cowloop_device *);
 static int	cowlo_openrdo     (struct cowloop_device *, char *);
+static int	cowlo_openlayers  (struct cowloop_device *, char *,
+							unsigned long);
+static int	cowlo_layerindex  (struct cowloop_device *);
+static int	cowlo_islayer     (struct cowloop_device *, struct inode *);
 static int	cowlo_opencow     (struct cowloop_device *, char *, int);
+static int	cowlo_convhead    (struct cowloop_device *, int);
+static int	cowlo_setmapunit  (struct cowloop_device *, unsigned long);
 static void	cowlo_undo_openrdo(struct cowloop_device *);
 static void	cowlo_undo_opencow(struct cowloop_device *);
+static int	cowlo_recover     (struct cowloop_device *);
+static void	cowlo_recoverrange(struct cowloop_device *, char *,
+							loff_t, loff_t);
 
 /*****************************************************************************/
 /* System call handling                                                      */
@@ -641,6 +1259,7 @@ cowlo_makepair(struct cowpair __user *arg)
 	struct cowpair	cowpair;
 	unsigned char	*cowpath;
 	unsigned char	*rdopath;
+	unsigned char	*lowpath = NULL;
 
 	/*
 	** retrieve info about pathnames
@@ -654,10 +1273,14 @@ cowlo_makepair(struct cowpair __user *arg)
 	if ( (MINOR(cowpair.device) >= maxcows)  && (cowpair.device != ANYDEV) )
 		return -EINVAL;
 
+	if (cowpair.flags & ~PAIRFLAGS)
+		return -EINVAL;
+
 	/*
 	** retrieve pathname strings
 	*/
-	if ( (cowpair.cowflen > PATH_MAX) || (cowpair.rdoflen > PATH_MAX) )
+	if ( (cowpair.cowflen > PATH_MAX) || (cowpair.rdoflen > PATH_MAX) ||
+	     (cowpair.lowflen > COWMAXLAYERS * (PATH_MAX+1)) )
 		return -ENAMETOOLONG;
 
 	if ( !(cowpath = kmalloc(cowpair.cowflen+1, GFP_KERNEL)) )
@@ -683,6 +1306,26 @@ cowlo_makepair(struct cowpair __user *arg)
 	}
 	*(rdopath+cowpair.rdoflen) = 0;
 
+	/*
+	** pathnames of lower cowfiles (if any)
+	*/
+	if (cowpair.lowflen) {
+		if ( !(lowpath = kmalloc(cowpair.lowflen+1, GFP_KERNEL)) ) {
+			kfree(rdopath);
+			kfree(cowpath);
+			return -ENOMEM;
+		}
+
+		if ( copy_from_user(lowpath, (void __user *)cowpair.lowfiles,
+		                                            cowpair.lowflen) ) {
+			kfree(lowpath);
+			kfree(rdopath);
+			kfree(cowpath);
+			return -EFAULT;
+		}
+		*(lowpath+cowpair.lowflen) = 0;
+	}
+
 	/*
 	** open new cowdevice
 	*/
@@ -692,12 +1335,16 @@ cowlo_makepair(struct cowpair __user *arg)
 		*/
 		for (i=0, rv=-EBUSY; i < maxcows; i++) {
 			if ( !((cowdevall[i])->state & COWDEVOPEN) ) {
-				rv = cowlo_openpair(rdopath, cowpath, 0, i);
+				rv = cowlo_openpair(rdopath, cowpath, 0, i,
+						cowpair.flags, cowpair.mapunit ?
+						cowpair.mapunit : MAPUNIT,
+						lowpath, cowpair.lowflen);
 				break;
 			}
 		}
 
 		if (rv) { 		/* open failed? */
+			kfree(lowpath);
 			kfree(rdopath);
 			kfree(cowpath);
 			return rv;
@@ -709,13 +1356,17 @@ cowlo_makepair(struct cowpair __user *arg)
 		cowpair.device = MKDEV(COWMAJOR, i);
 
 		if ( copy_to_user(arg, &cowpair, sizeof cowpair)) {
+			kfree(lowpath);
 			kfree(rdopath);
 			kfree(cowpath);
 			return -EFAULT;
 		}
 	} else { 		/* specific minor requested */
 		if ( (rv = cowlo_openpair(rdopath, cowpath, 0,
-						MINOR(cowpair.device)))) {
+				MINOR(cowpair.device), cowpair.flags,
+				cowpair.mapunit ? cowpair.mapunit : MAPUNIT,
+				lowpath, cowpair.lowflen))) {
+			kfree(lowpath);
 			kfree(rdopath);
 			kfree(cowpath);
 			return rv;
@@ -933,6 +1584,13 @@ cowlo_cowctl(unsigned long __user *arg, int cmd)
 		** if the cowfile is still open
 		*/
 		if (cowdev->state & COWCOWOPEN) {
+			/*
+			** the bitmap chunks can not be read any more
+			** afterwards, so get them all in memory now
+			*/
+			if ( !cowlo_loadmap(cowdev, 0, cowdev->numblocks, 0) )
+				return -ENOMEM;
+
 			/*
 			** close the cowfile
 			*/
@@ -953,7 +1611,13 @@ cowlo_cowctl(unsigned long __user *arg, int cmd)
 
 /*
 ** function to be called by core-kernel to handle the I/O-requests
-** in the queue
+** in the queue (called with the queue-spinlock held)
+**
+** the requests are moved to the private list of the cowdevice, until
+** the maximum number of requests in progress has been reached; the
+** remaining requests are left in the request-queue (to be merged with
+** new ones) and will be fetched as soon as a kernel-thread has finished
+** a request
 */
 static void
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,25))
@@ -963,313 +1627,2481 @@ cowlo_request(request_queue_t *q)
 #endif
 {
 	struct request		*req;
-	struct cowloop_device	*cowdev;
+	struct cowloop_device	*cowdev = q->queuedata;
 
 	DEBUGP(DCOW "cowloop - request function called....\n");
 
-	//while((req = elv_next_request(q)) != NULL) {
-	while((req = blk_fetch_request(q)) != NULL) {
+	while (cowdev->inflight < cowdev->qdepth &&
+	       (req = blk_fetch_request(q)) != NULL) {
 		DEBUGP(DCOW "cowloop - got next request\n");
 
-		//if (! blk_fs_request(req)) {
-		if (req == NULL) {
-               		 /* this is not a normal file system request */
-                	//end_request(req, 0);
-			printk(KERN_ALERT"[end_request] 1\n");
-                	__blk_end_request_cur(req, 0);
-                	continue;
-        	}
-		cowdev = req->rq_disk->private_data;
-
-		if (cowdev->iobusy)
-			return;
-		else
-			cowdev->iobusy = 1;
+		if (req->cmd_type != REQ_TYPE_FS && !COWFLUSHREQ(req)) {
+			/* this is not a normal file system request */
+			__blk_end_request_all(req, -EIO);
+			continue;
+		}
 
 		/*
 		** when no kernel-thread is available, the request will
 		** produce an I/O-error
 		*/
-		if (!cowdev->pid) {
+		if (!cowdev->nrrunning) {
 			printk(KERN_ERR"cowloop - no thread available\n");
-			//end_request(req, 0);	/* request failed */
-			printk(KERN_ALERT"[end_request] 2\n");
-			__blk_end_request_all(req, 0);	/* request failed */
-			cowdev->iobusy	= 0;
+			__blk_end_request_all(req, -EIO);	/* request failed */
 			continue;
 		}
 
 		/*
-		** handle I/O-request in the context of the kernel-thread
+		** handle I/O-request in the context of one of the
+		** kernel-threads
 		*/
-		cowdev->req 	= req;
-		cowdev->qfilled	= 1;
+		list_add_tail(&req->queuelist, &cowdev->reqlist);
+		cowdev->inflight++;
+
+		wake_up_interruptible(&cowdev->waitq);
+	}
+}
 
-		wake_up_interruptible_sync(&cowdev->waitq);
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,36))
+/*
+** prepare a request to flush the write cache of the cowdevice,
+** issued by the block layer around a barrier request
+*/
+static void
+cowlo_prepflush(struct request_queue *q, struct request *req)
+{
+	req->cmd_type = REQ_TYPE_LINUX_BLOCK;
+	req->cmd[0]   = REQ_LB_OP_FLUSH;
+}
+#endif
 
-		/*
-		** get out of this function now while the I/O-request is
-		** under treatment of the kernel-thread; this function
-		** will be called again after the current I/O-request has
-		** been finished by the thread
-		*/
-		return;
+/*
+** make_request function of the cowdevice, only used when the
+** read-only file is a block device
+**
+** a read that only concerns blocks that reside in the read-only file
+** is remapped to the block device below (the cowdevice has the same
+** sector numbering) and resubmitted by the block layer; all other bios
+** are queued as requests for the kernel-threads
+**
+** returns:
+** 	0   - bio has been handled
+**      1   - bio has been remapped
+*/
+static int
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,25))
+cowlo_make_request(struct request_queue *q, struct bio *bio)
+#else
+cowlo_make_request(request_queue_t *q, struct bio *bio)
+#endif
+{
+	struct cowloop_device	*cowdev = q->queuedata;
+	loff_t			offset  = (loff_t)bio->bi_sector << 9;
+	unsigned long long	first, last;
+	int			owner = 0;
+
+	first = offset >> cowdev->mushift;
+	last  = (offset + bio->bi_size + cowdev->mumask) >> cowdev->mushift;
+
+	/*
+	** bitmap chunks that are not yet in memory can not be read
+	** here, so such a bio is queued for the kernel-threads
+	** (as well as a bio for blocks in a lower cowfile)
+	*/
+	if ( bio_data_dir(bio) == READ && bio->bi_size > 0 &&
+	     cowlo_maploaded(cowdev, first, last) &&
+	     cowlo_checkio(cowdev, bio->bi_size, offset) == ALLRDO &&
+	     (!cowdev->layermap ||
+	      (cowlo_layerextent(cowdev, first, last, &owner) == last &&
+	       owner == 0)) ) {
+		bio->bi_bdev = cowdev->belowdev;
+		atomic_inc(&cowdev->rdopassed);
+		return 1;
 	}
+
+	return cowdev->mkrequest(q, bio);
 }
 
 /*
-** daemon-process (kernel-thread) executes this function
+** daemon-process (kernel-thread) executes this function;
+** several of these threads are started for every cowdevice
 */
 static int
-cowlo_daemon(struct cowloop_device *cowdev)
+cowlo_daemon(struct cowlo_worker *worker)
 {
-	int	rv;
-	int     minor;
-	char	myname[16];
+	struct cowloop_device	*cowdev = worker->cowdev;
+	struct request		*req;
+	int			rv;
+	int     		minor;
+	char			myname[16];
 
 	for (minor = 0; minor < maxcows; minor++) {
 		if (cowdev == cowdevall[minor]) break;
 	}
-	sprintf(myname, "cowloopd%d", minor);
+	sprintf(myname, "cowloopd%d/%d", minor, worker->index);
 
         daemonize(myname);
 
 	while (!cowdev->closedown) {
 		/*
 		** sleep while waiting for an I/O request;
-		** note that no non-interruptible wait has been used
-		** because the non-interruptible version of
-		** a *synchronous* wake_up does not exist (any more)
+		** only one of the waiting threads is woken up per
+		** request (exclusive wait)
 		*/
-		if (wait_event_interruptible(cowdev->waitq, cowdev->qfilled)){
+		if (wait_event_interruptible_exclusive(cowdev->waitq,
+		       !list_empty(&cowdev->reqlist) || cowdev->closedown)) {
 			flush_signals(current); /* ignore signal-based wakeup */
 			continue;
 		}
 
-		if (cowdev->closedown)		/* module will be unloaded ? */{
-			cowdev->pid = 0;
-			return 0;
-		}
+		if (cowdev->closedown)		/* module will be unloaded ? */
+			break;
 
 		/*
-		** woken up by the I/O-request handler:	treat requested I/O
-		*/
-		cowdev->qfilled = 0;
-	
-		rv = cowlo_do_request(cowdev->req);
-	
-		/*
-		** reacquire the queue-spinlock for manipulating
-		** the request-queue and dequeue the request
+		** woken up by the I/O-request handler: take the first
+		** request from the list (another thread might have been
+		** faster)
 		*/
 		spin_lock_irq(&cowdev->rqlock);
-	
-		//end_request(cowdev->req, rv);
-		printk(KERN_ALERT"[end_request] 3\n");
-		__blk_end_request_cur(cowdev->req, 0);	/* request failed */
-		cowdev->iobusy = 0;
+
+		if (list_empty(&cowdev->reqlist)) {
+			spin_unlock_irq(&cowdev->rqlock);
+			continue;
+		}
+
+		req = list_first_entry(&cowdev->reqlist,
+		                       struct request, queuelist);
+		list_del_init(&req->queuelist);
+
+		spin_unlock_irq(&cowdev->rqlock);
 
 		/*
-		** initiate the next request from the queue
+		** treat requested I/O (all segments in one pass)
 		*/
-		cowlo_request(cowdev->rqueue);
+		rv = cowlo_do_request(worker, req);
 
-		spin_unlock_irq(&cowdev->rqlock);
+		if (rv == COWASYNC)	/* ended later by I/O-completion */
+			continue;
+
+		cowlo_endrequest(cowdev, req, rv ? 0 : -EIO, worker->nrio);
 	}
+
+	spin_lock_irq(&cowdev->rqlock);
+	worker->pid = 0;
+	cowdev->nrrunning--;
+	spin_unlock_irq(&cowdev->rqlock);
+
 	return 0;
 }
 
 /*
-** function to be called in the context of the kernel thread
-** to handle the queued I/O-requests 
-**
-** returns:
-** 	0   - fail
-**      1   - success
+** end a request that has been handled with the given number of
+** backing I/Os and initiate the next request(s) from the queue
 */
-static long int
-cowlo_do_request(struct request *req)
+static void
+cowlo_endrequest(struct cowloop_device *cowdev, struct request *req,
+						int error, int nrio)
 {
-	unsigned long		len;
-	long int		rv;
-	struct cowloop_device	*cowdev = req->rq_disk->private_data;
-	loff_t 			offset;
-
 	/*
-	** calculate some variables which are needed later on
+	** acquire the queue-spinlock for manipulating the request-queue
 	*/
-	//len     =          req->current_nr_sectors << 9;
-	//offset  = (loff_t) req->sector             << 9;
+	spin_lock_irq(&cowdev->rqlock);
 
-	len	=		blk_rq_cur_sectors(req) << 9;
-	offset	= (loff_t) 	blk_rq_pos(req) << 9;
+	__blk_end_request_all(req, error);
 
-	printk(KERN_ALERT"[do_request] blk_rq_cur_sectors(req) : %llu\n", blk_rq_cur_sectors(req));
-	printk(KERN_ALERT"[do_request] blk_rq_pos(req) : %llu\n", blk_rq_pos(req));
+	cowdev->nrrequests++;
+	cowdev->nrbackios += nrio;
 
-	DEBUGP(DCOW"cowloop - req cmd=%d offset=%lld len=%lu addr=%p\n",
-				*(req->cmd), offset, len, req->buffer);
+	if (cowdev->maxbackios < nrio)
+		cowdev->maxbackios = nrio;
 
-	/*
-	** handle READ- or WRITE-request
-	*/
-	switch (rq_data_dir(req)) {
-	   /**********************************************************/
-	   case READ:
-	   	printk(KERN_ALERT"[do_request] READ : %lu\n", READ);
-		switch ( cowlo_checkio(cowdev, len, offset) ) {
-		   case ALLCOW:
-			rv = cowlo_readcow(cowdev, req->buffer, len, offset);
-			break;
+	cowdev->inflight--;
+	cowlo_request(cowdev->rqueue);
 
-		   case ALLRDO:
-			rv = cowlo_readrdo(cowdev, req->buffer, len, offset);
-			break;
+	spin_unlock_irq(&cowdev->rqlock);
+}
 
-	   	   case MIXEDUP:
-			rv = cowlo_readmix(cowdev, req->buffer, len, offset); 
-			break;
+/*
+** asynchronous I/O-thread executes this function;
+** several of these threads are started for a cowdevice that has been
+** activated with asynchronous I/O on the backing files
+*/
+static int
+cowlo_aiodaemon(struct cowlo_iothread *iothread)
+{
+	struct cowloop_device	*cowdev = iothread->cowdev;
+	struct cowlo_aio	*aio;
+	long int		rv;
+	int     		minor;
+	char			myname[16];
 
-		   default:
-			rv = 0;	/* never happens */
-		}
-		break;
+	for (minor = 0; minor < maxcows; minor++) {
+		if (cowdev == cowdevall[minor]) break;
+	}
+	sprintf(myname, "cowloopa%d/%d", minor, iothread->index);
 
-	   /**********************************************************/
-	   case WRITE:
-	   	printk(KERN_ALERT"[do_request] WRITE : %lu\n", WRITE);
-		switch ( cowlo_checkio(cowdev, len, offset) ) {
-		   case ALLCOW:
-			/*
-			** straight-forward write will do...
-			*/
-			DEBUGP(DCOW"cowloop - write straight ");
+        daemonize(myname);
 
-			rv = cowlo_writecow(cowdev, req->buffer, len, offset);
-			break;	/* from switch */
+	while (1) {
+		if (wait_event_interruptible_exclusive(cowdev->aiowaitq,
+		       !list_empty(&cowdev->aiolist) || cowdev->closedown)) {
+			flush_signals(current); /* ignore signal-based wakeup */
+			continue;
+		}
+
+		/*
+		** take the first backing I/O from the list; pending
+		** I/Os are still finished when the module is unloaded
+		*/
+		spin_lock(&cowdev->aiolock);
+
+		if (list_empty(&cowdev->aiolist)) {
+			spin_unlock(&cowdev->aiolock);
+
+			if (cowdev->closedown)
+				break;
+			continue;
+		}
+
+		aio = list_first_entry(&cowdev->aiolist,
+		                       struct cowlo_aio, list);
+		list_del_init(&aio->list);
+
+		spin_unlock(&cowdev->aiolock);
+
+		/*
+		** issue the I/O and report completion
+		*/
+		rv = aio->func(cowdev, aio->iov, aio->nriov,
+						aio->len, aio->offset);
+
+		aio->done(aio, rv);
+	}
+
+	spin_lock(&cowdev->aiolock);
+	iothread->pid = 0;
+	cowdev->nriorunning--;
+	spin_unlock(&cowdev->aiolock);
+
+	return 0;
+}
+
+/*
+** pass a backing I/O to the asynchronous I/O-threads
+*/
+static void
+cowlo_aiosubmit(struct cowloop_device *cowdev, struct cowlo_aio *aio)
+{
+	spin_lock(&cowdev->aiolock);
+	list_add_tail(&aio->list, &cowdev->aiolist);
+	spin_unlock(&cowdev->aiolock);
+
+	wake_up_interruptible(&cowdev->aiowaitq);
+}
+
+/*
+** completion function for the backing I/O of a request
+** that is handled asynchronously
+*/
+static void
+cowlo_areqdone(struct cowlo_aio *aio, long int rv)
+{
+	struct cowlo_areq	*areq = aio->private;
+
+	if (rv <= 0)
+		areq->error = -EIO;
+
+	if ( !atomic_dec_and_test(&areq->pending) )
+		return;
+
+	cowlo_endrequest(areq->cowdev, areq->req, areq->error, areq->nraio);
+
+	kfree(areq);
+}
+
+/*
+** allocate the administration for a request that will be handled
+** with the given number of backing I/Os, using at most the given
+** number of segments in total
+*/
+static struct cowlo_areq *
+cowlo_allocareq(struct cowloop_device *cowdev, struct request *req,
+						int nraio, int nriov)
+{
+	struct cowlo_areq	*areq;
+	int			i;
+
+	areq = kmalloc(sizeof *areq + nraio * sizeof(struct cowlo_aio) +
+				nriov * sizeof(struct iovec), GFP_NOIO);
+	if (!areq)
+		return NULL;
+
+	areq->req	= req;
+	areq->cowdev	= cowdev;
+	areq->error	= 0;
+	areq->nraio	= nraio;
+	atomic_set(&areq->pending, nraio);
+
+	for (i=0; i < nraio; i++) {
+		areq->aio[i].done	= cowlo_areqdone;
+		areq->aio[i].private	= areq;
+	}
+
+	return areq;
+}
+
+/*
+** handle a request that can be served by one backing I/O
+** asynchronously; the request is ended by the completion function
+**
+** returns:
+** 	0   - no memory available (handle request synchronously)
+**      1   - backing I/O submitted
+*/
+static int
+cowlo_submitreq(struct cowloop_device *cowdev, struct request *req,
+		struct cowlo_vec *vec,
+		long int (*func)(struct cowloop_device *,
+				 const struct iovec *, int, int, loff_t),
+		int len, loff_t offset)
+{
+	struct cowlo_areq	*areq;
+	struct iovec		*iov;
+
+	if ( !(areq = cowlo_allocareq(cowdev, req, 1, vec->nriov)) )
+		return 0;
+
+	iov = (struct iovec *)(areq->aio + 1);
+
+	memcpy(iov, vec->iov, vec->nriov * sizeof(struct iovec));
+
+	areq->aio[0].func	= func;
+	areq->aio[0].iov	= iov;
+	areq->aio[0].nriov	= vec->nriov;
+	areq->aio[0].len	= len;
+	areq->aio[0].offset	= offset;
+
+	cowlo_aiosubmit(cowdev, &areq->aio[0]);
+
+	return 1;
+}
+
+/*
+** handle a read-request of which the blocks reside partly in the
+** rdofile and partly in the cowfile asynchronously: every extent
+** of blocks that reside in the same file is read by a separate
+** backing I/O and the request is ended when all of them completed
+**
+** returns:
+** 	0   - no memory available (handle request synchronously)
+**      1   - backing I/Os submitted
+*/
+static int
+cowlo_submitmix(struct cowloop_device *cowdev, struct request *req,
+			struct cowlo_vec *vec, int len, loff_t offset)
+{
+	struct cowlo_areq	*areq;
+	struct iovec		*iov;
+	unsigned long long	blocknr, last, next;
+	unsigned long		partlen, done;
+	int			i, nraio, nr, incow;
+
+	/*
+	** count the extents involved
+	*/
+	last = (offset + len + cowdev->mumask) >> cowdev->mushift;
+
+	for (nraio=0, blocknr = offset >> cowdev->mushift; blocknr < last;
+								nraio++)
+		blocknr = cowlo_mapextent(cowdev, blocknr, last, &incow);
+
+	if ( !(areq = cowlo_allocareq(cowdev, req, nraio,
+						vec->nriov + nraio)) )
+		return 0;
+
+	iov = (struct iovec *)(areq->aio + nraio);
+
+	/*
+	** describe a backing I/O per extent; a block that has been
+	** copied to the cowfile meanwhile (concurrent write) may be
+	** part of the last extent, which is as valid as reading
+	** it before the write (such writes might also have merged
+	** extents, so less backing I/Os may be needed)
+	*/
+	for (i=0, done=0; i < nraio && len > 0; i++, len-=partlen,
+					done+=partlen, offset+=partlen) {
+		next	= cowlo_mapextent(cowdev, offset >> cowdev->mushift,
+							last, &incow);
+		if (i == nraio-1)
+			next = last;
+
+		partlen	= ((loff_t)next << cowdev->mushift) - offset;
+		if (partlen > len)
+			partlen = len;
+
+		nr	= cowlo_iovslice(vec, done, partlen, vec->tmp);
+
+		memcpy(iov, vec->tmp, nr * sizeof(struct iovec));
+
+		areq->aio[i].func	= incow ? cowlo_readcowv :
+						  cowlo_readrdov;
+		areq->aio[i].iov	= iov;
+		areq->aio[i].nriov	= nr;
+		areq->aio[i].len	= partlen;
+		areq->aio[i].offset	= offset;
+
+		iov += nr;
+	}
+
+	areq->nraio = nraio = i;
+	atomic_set(&areq->pending, nraio);
+
+	for (i=0; i < nraio; i++)
+		cowlo_aiosubmit(cowdev, &areq->aio[i]);
+
+	return 1;
+}
+
+/*
+** build the description of the data area of a request
+**
+** note that the request-queue bounces highmem pages (BLK_BOUNCE_HIGH),
+** so every segment is directly addressable by the kernel-thread
+**
+** returns:
+** 	>= 0 - number of segments
+**      < 0  - request contains too many segments (never happens)
+*/
+static int
+cowlo_mapreq(struct request *req, struct iovec *iov)
+{
+	struct req_iterator	iter;
+	struct bio_vec		*bvec;
+	char			*addr;
+	int			nr = 0;
+
+	rq_for_each_segment(bvec, req, iter) {
+		addr = page_address(bvec->bv_page) + bvec->bv_offset;
+
+		/*
+		** combine with previous segment when adjacent in memory
+		*/
+		if (nr && (char *)iov[nr-1].iov_base+iov[nr-1].iov_len == addr){
+			iov[nr-1].iov_len += bvec->bv_len;
+			continue;
+		}
+
+		if (nr == COWMAXSEGS)
+			return -1;
+
+		iov[nr].iov_base = addr;
+		iov[nr].iov_len  = bvec->bv_len;
+		nr++;
+	}
+
+	return nr;
+}
+
+/*
+** describe the subrange [skip, skip+len) of the data area of a request
+** in (part of) the scratch area of the vector
+**
+** returns: number of segments stored in dst
+*/
+static int
+cowlo_iovslice(struct cowlo_vec *vec, unsigned long skip, unsigned long len,
+							struct iovec *dst)
+{
+	struct iovec	*src = vec->iov;
+	int		i, n;
+
+	for (i=0; i < vec->nriov && skip >= src[i].iov_len; i++)
+		skip -= src[i].iov_len;
+
+	for (n=0; i < vec->nriov && len > 0; i++, n++) {
+		dst[n].iov_base = (char *)src[i].iov_base + skip;
+		dst[n].iov_len  = src[i].iov_len - skip;
+
+		if (dst[n].iov_len > len)
+			dst[n].iov_len = len;
+
+		len  -= dst[n].iov_len;
+		skip  = 0;
+	}
+
+	return n;
+}
+
+/*
+** copy the subrange [skip, skip+len) of a segmented data area
+** to a contiguous buffer
+*/
+static void
+cowlo_iovget(const struct iovec *iov, int nriov, unsigned long skip,
+					void *buf, unsigned long len)
+{
+	unsigned long	partlen;
+
+	for (; nriov > 0 && len > 0; iov++, nriov--) {
+		if (skip >= iov->iov_len) {
+			skip -= iov->iov_len;
+			continue;
+		}
+
+		partlen = iov->iov_len - skip;
+		if (partlen > len)
+			partlen = len;
+
+		memcpy(buf, (char *)iov->iov_base + skip, partlen);
+
+		buf  += partlen;
+		len  -= partlen;
+		skip  = 0;
+	}
+}
+
+/*
+** copy a contiguous buffer to the subrange [skip, skip+len)
+** of a segmented data area
+*/
+static void
+cowlo_iovput(const struct iovec *iov, int nriov, unsigned long skip,
+					const void *buf, unsigned long len)
+{
+	unsigned long	partlen;
+
+	for (; nriov > 0 && len > 0; iov++, nriov--) {
+		if (skip >= iov->iov_len) {
+			skip -= iov->iov_len;
+			continue;
+		}
+
+		partlen = iov->iov_len - skip;
+		if (partlen > len)
+			partlen = len;
+
+		memcpy((char *)iov->iov_base + skip, buf, partlen);
+
+		buf  += partlen;
+		len  -= partlen;
+		skip  = 0;
+	}
+}
+
+/*
+** check if a data area only contains binary zeroes
+**
+** returns:
+** 	0   - not all zeroes
+**      1   - all zeroes
+*/
+static int
+cowlo_iszero(const char *p, unsigned long len)
+{
+	unsigned long	partlen;
+
+	for (; len > 0; p += partlen, len -= partlen) {
+		partlen = len < MAPUNIT ? len : MAPUNIT;
+
+		if ( memcmp(p, allzeroes, partlen) )
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+** check if the subrange [skip, skip+len) of a segmented data area
+** only contains binary zeroes
+**
+** returns:
+** 	0   - not all zeroes
+**      1   - all zeroes
+*/
+static int
+cowlo_iovzero(const struct iovec *iov, int nriov, unsigned long skip,
+							unsigned long len)
+{
+	unsigned long	partlen;
+
+	for (; nriov > 0 && len > 0; iov++, nriov--) {
+		if (skip >= iov->iov_len) {
+			skip -= iov->iov_len;
+			continue;
+		}
+
+		partlen = iov->iov_len - skip;
+		if (partlen > len)
+			partlen = len;
+
+		if ( !cowlo_iszero((char *)iov->iov_base + skip, partlen) )
+			return 0;
+
+		len  -= partlen;
+		skip  = 0;
+	}
+
+	return 1;
+}
+
+/*
+** fill the subrange [skip, skip+len) of a segmented data area
+** with binary zeroes
+*/
+static void
+cowlo_iovclear(const struct iovec *iov, int nriov, unsigned long skip,
+							unsigned long len)
+{
+	unsigned long	partlen;
+
+	for (; nriov > 0 && len > 0; iov++, nriov--) {
+		if (skip >= iov->iov_len) {
+			skip -= iov->iov_len;
+			continue;
+		}
+
+		partlen = iov->iov_len - skip;
+		if (partlen > len)
+			partlen = len;
+
+		memset((char *)iov->iov_base + skip, 0, partlen);
+
+		len  -= partlen;
+		skip  = 0;
+	}
+}
+
+/*
+** function to be called in the context of the kernel thread
+** to handle the queued I/O-requests 
+**
+** the entire request (all segments of all bios) is handled in one
+** pass: every contiguous range that resides in one file is transferred
+** with one (vectored) read or write
+**
+** with asynchronous I/O, a request that can be served by one backing
+** I/O without modifying the bitmap is passed to the I/O-threads
+**
+** returns:
+** 	0        - fail
+**      1        - success
+**      COWASYNC - request will be ended by I/O-completion
+*/
+static long int
+cowlo_do_request(struct cowlo_worker *worker, struct request *req)
+{
+	unsigned long		len;
+	long int		rv;
+	int			iotype, locked = 0;
+	struct cowloop_device	*cowdev = req->rq_disk->private_data;
+	struct cowlo_vec	vec;
+	struct cowlo_range	range;
+	loff_t 			offset;
+
+	/*
+	** calculate some variables which are needed later on
+	*/
+	len	=		blk_rq_bytes(req);
+	offset	= (loff_t) 	blk_rq_pos(req) << 9;
+
+	/*
+	** a flush request makes all writes that have been ended so far
+	** durable; it might carry data to be written afterwards
+	*/
+	if ( COWFLUSHREQ(req) ) {
+		worker->nrio = 0;
+
+		if ( !cowlo_commit(cowdev) )
+			return 0;
+
+		if (len == 0)
+			return 1;
+	}
+
+	/*
+	** a discard request carries no data
+	*/
+	if (req->cmd_flags & REQ_DISCARD) {
+		worker->nrio = 0;
+		return cowlo_discard(cowdev, len, offset);
+	}
+
+	vec.iov	  = worker->iov;
+	vec.tmp	  = worker->tmp;
+	vec.nriov = cowlo_mapreq(req, vec.iov);
+	vec.nrio  = 0;
+
+	worker->nrio = 0;
+
+	DEBUGP(DCOW"cowloop - req cmd=%d offset=%lld len=%lu segs=%d\n",
+				*(req->cmd), offset, len, vec.nriov);
+
+	if (vec.nriov < 0) {
+		printk(KERN_ERR
+		       "cowloop - request with too many segments\n");
+		return 0;
+	}
+
+	/*
+	** the bitmap chunks for the blocks of this request should
+	** be in memory before the request can be handled
+	*/
+	if ( !cowlo_loadmap(cowdev, offset >> cowdev->mushift,
+	               (offset + len + cowdev->mumask) >> cowdev->mushift, 0) ) {
+		printk(KERN_ERR
+		       "cowloop - cannot read bitmap for request\n");
+		return 0;
+	}
+
+	/*
+	** handle READ- or WRITE-request
+	*/
+	switch (rq_data_dir(req)) {
+	   /**********************************************************/
+	   case READ:
+		switch ( cowlo_checkio(cowdev, len, offset) ) {
+		   case ALLCOW:
+			if ( (cowdev->pairflags & PAIRAIO) &&
+			     cowlo_submitreq(cowdev, req, &vec,
+			                     cowlo_readcowv, len, offset) )
+				return COWASYNC;
+
+			rv = cowlo_readcowv(cowdev, vec.iov, vec.nriov,
+							len, offset);
+			vec.nrio++;
+			break;
 
 		   case ALLRDO:
-			if ( (len & MUMASK) == 0) {
-				DEBUGP(DCOW"cowloop - write straight ");
+			if ( (cowdev->pairflags & PAIRAIO) &&
+			     cowlo_submitreq(cowdev, req, &vec,
+			                     cowlo_readrdov, len, offset) )
+				return COWASYNC;
+
+			rv = cowlo_readrdov(cowdev, vec.iov, vec.nriov,
+							len, offset);
+			vec.nrio++;
+			break;
+
+	   	   case MIXEDUP:
+			if ( (cowdev->pairflags & PAIRAIO) &&
+			     cowlo_submitmix(cowdev, req, &vec, len, offset) )
+				return COWASYNC;
+
+			rv = cowlo_readmix(cowdev, &vec, len, offset); 
+			break;
+
+		   default:
+			rv = 0;	/* never happens */
+		}
+		break;
+
+	   /**********************************************************/
+	   case WRITE:
+		/*
+		** entire blocks that are written with binary zeroes only
+		** become holes in the cowfile (if wanted), so no data
+		** has to be written at all
+		*/
+		if ( (cowdev->pairflags & PAIRZERO) && !cowdev->nopunch &&
+		     ((len | offset) & cowdev->mumask) == 0 &&
+		     cowlo_iovzero(vec.iov, vec.nriov, 0, len) ) {
+			rv = cowlo_zerorange(cowdev, offset >> cowdev->mushift,
+			               (offset + len) >> cowdev->mushift);
+
+			if (rv == 0) {
+				cowdev->zerowrites++;
+				cowdev->zeroblocks += len >> cowdev->mushift;
+				rv = 1;
+				break;
+			}
+
+			if (rv != -EOPNOTSUPP)
+				break;		/* failed */
+
+			/*
+			** no holes in cowfile: write the zeroes after all
+			*/
+		}
+
+		iotype = cowlo_checkio(cowdev, len, offset);
+
+		/*
+		** writes that might modify the bitmap are serialized
+		** when they concern the same blocks; the situation has
+		** to be checked again once the range has been locked
+		** (writes to a dense cowfile might modify the slot map)
+		*/
+		if (iotype != ALLCOW ||
+		    (cowdev->cowhead->flags & COWDENSE)) {
+			down_read(&cowdev->cowsem);
+			cowlo_lockrange(cowdev, &range,
+				offset >> cowdev->mushift,
+				(offset + len + cowdev->mumask) >> cowdev->mushift);
+			locked = 1;
+			iotype = cowlo_checkio(cowdev, len, offset);
+
+			/*
+			** bits will be set: shared zero chunks
+			** have to be replaced by private chunks
+			*/
+			if (iotype != ALLCOW &&
+			    !cowlo_loadmap(cowdev, offset >> cowdev->mushift,
+			         (offset + len + cowdev->mumask) >>
+			                                 cowdev->mushift, 1)) {
+				printk(KERN_ERR "cowloop - cannot get "
+				       "space for bitmap of request\n");
+				iotype = 0;
+			}
+		}
+
+		switch (iotype) {
+		   case ALLCOW:
+			/*
+			** straight-forward write will do...
+			*/
+			DEBUGP(DCOW"cowloop - write straight ");
+
+			if ( (cowdev->pairflags & PAIRAIO) && !locked &&
+			     !COWFUAREQ(req) &&
+			     cowlo_submitreq(cowdev, req, &vec,
+			                     cowlo_writecowv, len, offset) )
+				return COWASYNC;
+
+			rv = cowlo_writecowv(cowdev, vec.iov, vec.nriov,
+							len, offset);
+			vec.nrio++;
+			break;	/* from switch */
+
+		   case ALLRDO:
+			if ( ((len | offset) & cowdev->mumask) == 0) {
+				DEBUGP(DCOW"cowloop - write straight ");
+
+				rv = cowlo_writecowv(cowdev, vec.iov,
+						vec.nriov, len, offset);
+				vec.nrio++;
+				break;
+			}
+
+	   	   case MIXEDUP:
+			rv = cowlo_writemix(cowdev, &vec, len, offset);
+			break;
+
+		   default:
+			rv = 0;	/* no space for bitmap */
+		}
+
+		if (locked) {
+			cowlo_unlockrange(cowdev, &range);
+			up_read(&cowdev->cowsem);
+		}
+
+		cowlo_slotreclaim(cowdev);
+		break;
+
+	   default:
+		printk(KERN_ERR
+		       "cowloop - unrecognized command %d\n", *(req->cmd));
+		rv = 0;
+	}
+
+	/*
+	** a forced-unit-access write is only ended when its data
+	** (and the bitmap) are durable
+	*/
+	if (rv > 0 && rq_data_dir(req) == WRITE && COWFUAREQ(req) &&
+	    !cowlo_commit(cowdev))
+		rv = 0;
+
+	worker->nrio = vec.nrio;
+
+	return (rv <= 0 ? 0 : 1);
+}
+
+/*
+** handle a discard request: all entire blocks of the range get a hole
+** in the cowfile and are marked as residing in the cowfile, so they
+** read as binary zeroes without accessing the read-only file
+** (the partial blocks at both ends are left untouched)
+**
+** returns:
+** 	0   - fail
+**      1   - success
+*/
+static int
+cowlo_discard(struct cowloop_device *cowdev, unsigned long len, loff_t offset)
+{
+	unsigned long long	first, last;
+
+	first = (offset + cowdev->mumask) >> cowdev->mushift;
+	last  = (offset + len) >> cowdev->mushift;
+
+	if (first >= last || cowdev->nopunch)
+		return 1;		/* a discard is only advisory */
+
+	switch ( cowlo_zerorange(cowdev, first, last) ) {
+	   case 0:
+		cowdev->discards++;
+		cowdev->discardblocks += last - first;
+		return 1;
+
+	   case -EOPNOTSUPP:
+		return 1;		/* discards ignored from now on */
+
+	   default:
+		return 0;
+	}
+}
+
+/*
+** let the blocks 'first' upto 'last' read as binary zeroes: they get
+** a hole in the cowfile and are marked as residing in the cowfile
+**
+** returns:
+** 	0   - okay
+**    < 0   - error value (-EOPNOTSUPP: holes not supported)
+*/
+static int
+cowlo_zerorange(struct cowloop_device *cowdev, unsigned long long first,
+						unsigned long long last)
+{
+	struct cowlo_range	range;
+	int			rv;
+
+	if ( !(cowdev->state & COWRWCOWOPEN) )
+		return -EBADF;
+
+	down_read(&cowdev->cowsem);
+	cowlo_lockrange(cowdev, &range, first, last);
+
+	if ( !cowlo_loadmap(cowdev, first, last, 1) ) {
+		printk(KERN_ERR
+		       "cowloop - cannot get space for bitmap of request\n");
+		rv = -ENOMEM;
+	} else if (cowdev->cowhead->flags & COWDENSE) {
+		/*
+		** dense cowfile: the slots of the blocks are freed
+		*/
+		cowlo_slotzero(cowdev, first, last);
+
+		rv = cowlo_markzero(cowdev, first, last) ? 0 : -EIO;
+	} else if ( (rv = cowlo_punchcow(cowdev, first, last)) == 0) {
+		if ( !cowlo_markzero(cowdev, first, last) )
+			rv = -EIO;
+	} else if (rv == -EOPNOTSUPP) {
+		printk(KERN_NOTICE
+		       "cowloop - no holes in cowfile %s; "
+		       "discards and zero writes are ignored\n",
+		       cowdev->cowname);
+		cowdev->nopunch = 1;
+	}
+
+	cowlo_unlockrange(cowdev, &range);
+	up_read(&cowdev->cowsem);
+
+	cowlo_slotreclaim(cowdev);
+
+	return rv;
+}
+
+/*
+** punch a hole in the cowfile for the data area of the blocks 'first'
+** upto 'last', so these blocks read as binary zeroes from the cowfile
+**
+** returns:
+** 	0   - okay
+**    < 0   - error value (-EOPNOTSUPP: holes not supported)
+*/
+static int
+cowlo_punchcow(struct cowloop_device *cowdev, unsigned long long first,
+						unsigned long long last)
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,38))
+	struct inode	*inode = cowdev->cowfp->f_dentry->d_inode;
+	loff_t		offset, len;
+	long int	rv;
+	char		zero = 0;
+
+	if (!inode->i_op || !inode->i_op->fallocate)
+		return -EOPNOTSUPP;
+
+	offset = cowdev->cowhead->doffset + ((loff_t)first << cowdev->mushift);
+	len    = (loff_t)(last - first) << cowdev->mushift;
+
+	rv = inode->i_op->fallocate(inode,
+			FALLOC_FL_KEEP_SIZE|FALLOC_FL_PUNCH_HOLE, offset, len);
+	if (rv)
+		return rv;
+
+	/*
+	** blocks beyond the end of the cowfile can not be read:
+	** extend the cowfile (the new part reads as binary zeroes)
+	*/
+	if (i_size_read(inode) < offset + len) {
+		if (cowlo_writecowraw(cowdev, &zero, 1, offset + len - 1) < 1)
+			return -EIO;
+	}
+
+	return 0;
+#else
+	return -EOPNOTSUPP;
+#endif
+}
+
+/*
+** mark the blocks 'first' upto 'last' as residing in the cowfile
+** without writing their data (their data area in the cowfile must
+** read as binary zeroes already); the blocks that were not yet marked
+** are logged in the journal, or otherwise the concerning parts of
+** the bitmap are flushed at once
+**
+** must be called with the cowsem read-locked and the range locked
+**
+** returns:
+** 	0   - fail
+**      1   - success
+*/
+static int
+cowlo_markzero(struct cowloop_device *cowdev, unsigned long long first,
+						unsigned long long last)
+{
+	unsigned long long	blocknr, next;
+	unsigned long		mapnum, from, to;
+	int			incow, nrjext = 0, modified = 0, markdirty = 0;
+	struct cowjext		jext[COWJBATCH];
+
+	for (blocknr = first; blocknr < last; blocknr = next) {
+		next = cowlo_mapextent(cowdev, blocknr, last, &incow);
+
+		if (incow)		/* already in cowfile */
+			continue;
+
+		if (cowdev->cowhead->flags & COWJOURNAL) {
+			jext[nrjext].first = blocknr;
+			jext[nrjext].count = next - blocknr;
+
+			if (++nrjext == COWJBATCH) {
+				cowlo_journal(cowdev, jext, nrjext);
+				nrjext = 0;
+			}
+		}
+
+		for (; blocknr < next; blocknr++) {
+			spin_lock(&cowdev->maplock);
+
+			*(*(cowdev->mapcache+CALCMAP(blocknr)) +
+				CALCBYTE(blocknr)) |= (1<<CALCBIT(blocknr));
+
+			set_bit(CALCMAP(blocknr), cowdev->mapdirty);
+
+			cowdev->nrcowblocks++;
+
+			if ( !(cowdev->cowhead->flags & COWDIRTY)) {
+				cowdev->cowhead->flags	|= COWDIRTY;
+				markdirty = 1;
+			}
+
+			spin_unlock(&cowdev->maplock);
+		}
+
+		modified = 1;
+	}
+
+	if (markdirty)
+		cowlo_writecowraw(cowdev, cowdev->cowhead, COWHEADSZ, (loff_t)0);
+
+	if (nrjext)
+		cowlo_journal(cowdev, jext, nrjext);
+
+	if (!modified || (cowdev->cowhead->flags & (COWJOURNAL|COWDENSE)))
+		return 1;
+
+	/*
+	** without journal these blocks can not be recovered later on
+	** (they read as binary zeroes), so flush the concerning parts
+	** of the bitmap now
+	*/
+	for (mapnum = CALCMAP(first); mapnum <= CALCMAP(last-1); mapnum++) {
+		from = mapnum == CALCMAP(first)  ? CALCBYTE(first) & ~MUMASK : 0;
+		to   = mapnum == CALCMAP(last-1) ? CALCBYTE(last-1) + 1
+		                                 : MAPCHUNKSZ;
+
+		if (cowlo_writecowraw(cowdev,
+				*(cowdev->mapcache+mapnum) + from, to - from,
+				(loff_t)cowdev->mapunit +
+				(loff_t)mapnum * MAPCHUNKSZ + from) < 0) {
+			printk(KERN_WARNING
+			       "cowloop - write-failure on bitmap - map=%ld\n",
+			       mapnum);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+** check if a range of blocks overlaps with a locked range
+**
+** must be called with the rangelock set
+*/
+static int
+cowlo_rangebusy(struct cowloop_device *cowdev, unsigned long long first,
+						unsigned long long last)
+{
+	struct cowlo_range	*r;
+
+	list_for_each_entry(r, &cowdev->rangelist, list) {
+		if (r->first < last && first < r->last)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+** lock a range of blocks for a write that might modify the bitmap;
+** wait as long as an overlapping range is locked by another write
+*/
+static void
+cowlo_lockrange(struct cowloop_device *cowdev, struct cowlo_range *range,
+			unsigned long long first, unsigned long long last)
+{
+	range->first = first;
+	range->last  = last;
+
+	spin_lock(&cowdev->rangelock);
+
+	while (cowlo_rangebusy(cowdev, first, last)) {
+		DEFINE_WAIT(wait);
+
+		prepare_to_wait(&cowdev->rangewaitq, &wait,
+						TASK_UNINTERRUPTIBLE);
+		spin_unlock(&cowdev->rangelock);
+
+		schedule();
+
+		finish_wait(&cowdev->rangewaitq, &wait);
+		spin_lock(&cowdev->rangelock);
+	}
+
+	list_add_tail(&range->list, &cowdev->rangelist);
+
+	spin_unlock(&cowdev->rangelock);
+}
+
+/*
+** unlock a range of blocks and wakeup writes that wait for it
+*/
+static void
+cowlo_unlockrange(struct cowloop_device *cowdev, struct cowlo_range *range)
+{
+	spin_lock(&cowdev->rangelock);
+	list_del(&range->list);
+	spin_unlock(&cowdev->rangelock);
+
+	wake_up_all(&cowdev->rangewaitq);
+}
+
+/*
+** check for a given I/O-request if all underlying blocks 
+** (with size mapunit) are either in the read-only file or in
+** the cowfile (or a combination of the two)
+**
+** returns:
+** 	ALLRDO  - all underlying blocks in rdofile
+**      ALLCOW  - all underlying blocks in cowfile
+**      MIXEDUP - underlying blocks partly in rdofile and partly in cowfile
+*/
+static int
+cowlo_checkio(struct cowloop_device *cowdev, int len, loff_t offset)
+{
+	unsigned long long	first, last;
+	int			incow;
+
+	/*
+	** notice that the requested block might cross
+	** a blocksize boundary while one of the concerned
+	** blocks resides in the read-only file and another
+	** one in the copy-on-write file; in that case the
+        ** request will be broken up into pieces
+	*/
+	first = offset >> cowdev->mushift;
+	last  = (offset + len + cowdev->mumask) >> cowdev->mushift;
+
+	if (cowlo_mapextent(cowdev, first, last, &incow) < last)
+		return MIXEDUP;
+
+	return incow ? ALLCOW : ALLRDO;
+}
+
+/*
+** determine the extent of blocks, starting at block 'first' and
+** ending before block 'last', that all reside in the same file;
+** the bitmap is searched a machine word at a time instead of
+** testing every bit
+**
+** returns: block number directly following the extent
+**          (*incow set to 1 if the extent resides in the cowfile)
+*/
+static unsigned long long
+cowlo_mapextent(struct cowloop_device *cowdev, unsigned long long first,
+				unsigned long long last, int *incow)
+{
+	unsigned long long	blocknr, chunkstart;
+	unsigned long		bitlim, bitnr;
+	char		*mc;
+
+	mc	= *(cowdev->mapcache + CALCMAP(first));
+	*incow	= (*(mc+CALCBYTE(first)) & (1<<CALCBIT(first))) != 0;
+
+	for (blocknr = first; blocknr < last; blocknr = chunkstart + bitlim) {
+		/*
+		** search within the bitmap chunk of this block for
+		** the first block that resides in the other file
+		*/
+		chunkstart = blocknr & ~(unsigned long long)(MAPCHUNKBITS-1);
+		mc	   = *(cowdev->mapcache + CALCMAP(blocknr));
+
+		if (last - chunkstart > MAPCHUNKBITS)
+			bitlim = MAPCHUNKBITS;
+		else
+			bitlim = last - chunkstart;
+
+		if (*incow)
+			bitnr = cowlo_find_next_zero_bit(mc, bitlim,
+							blocknr - chunkstart);
+		else
+			bitnr = cowlo_find_next_bit(mc, bitlim,
+							blocknr - chunkstart);
+
+		if (bitnr < bitlim)
+			return chunkstart + bitnr;
+	}
+
+	return last;
+}
+
+/*
+** get a bitmap chunk in memory; a chunk that has not been accessed
+** before is read from the cowfile (chunks are never released while
+** the cowfile is in use)
+** a chunk without any bit set refers to the shared zero chunk, until
+** the chunk is needed 'writable' to set bits in it
+**
+** returns: pointer to the chunk or NULL in case of failure
+*/
+static char *
+cowlo_mapchunk(struct cowloop_device *cowdev, unsigned long mapnum,
+							int writable)
+{
+	char		*mc;
+	unsigned long	numbytes;
+
+	if ( (mc = *(cowdev->mapcache+mapnum)) != NULL &&
+	     (!writable || mc != (char *)zerochunk) ) {
+		smp_read_barrier_depends();
+		return mc;
+	}
+
+	down(&cowdev->mapsem);
+
+	/*
+	** another kernel-thread might have loaded the chunk meanwhile
+	*/
+	if ( (mc = *(cowdev->mapcache+mapnum)) != NULL &&
+	     (!writable || mc != (char *)zerochunk) ) {
+		up(&cowdev->mapsem);
+		return mc;
+	}
+
+	if (mapnum < (cowdev->mapcount-1))
+		numbytes = MAPCHUNKSZ;
+	else
+		numbytes = cowdev->mapremain;	/* might be partly filled */
+
+	if ( (mc = kmalloc(numbytes, GFP_NOIO)) == NULL) {
+		printk(KERN_ERR "cowloop - no space for bitmapchunk %ld"
+				" totmapsz=%ld, mapcnt=%d mapunit=%lu\n",
+				mapnum, cowdev->mapsize, cowdev->mapcount,
+				cowdev->mapunit);
+		up(&cowdev->mapsem);
+		return NULL;
+	}
+
+	memset(mc, 0, numbytes);
+
+	if (*(cowdev->mapcache+mapnum) == NULL) {
+		/*
+		** chunk not yet read from the cowfile; when no bit
+		** is set, the shared zero chunk will do for now
+		** (a dense cowfile has its slot map read instead)
+		*/
+		if (cowdev->cowhead->flags & COWDENSE) {
+			if ( !cowlo_slotchunk(cowdev, mapnum, mc, 1) ) {
+				kfree(mc);
+				up(&cowdev->mapsem);
+				return NULL;
+			}
+		} else if (cowlo_readcowraw(cowdev, mc, numbytes,
+				(loff_t)cowdev->mapunit +
+				(loff_t)mapnum * MAPCHUNKSZ) < 0) {
+			kfree(mc);
+			up(&cowdev->mapsem);
+			return NULL;
+		}
+
+		cowdev->maploads++;
+
+		if (!writable && find_first_bit((unsigned long *)mc,
+					numbytes * 8) >= numbytes * 8) {
+			kfree(mc);
+			mc = (char *)zerochunk;
+
+			if (cowdev->cowhead->flags & COWDENSE) {
+				vfree(*(cowdev->slotcache+mapnum));
+				*(cowdev->slotcache+mapnum) = NULL;
+				cowdev->mapbytes -= SLOTCHUNKSZ(cowdev,
+								mapnum);
+			}
+		}
+	} else if ( (cowdev->cowhead->flags & COWDENSE) &&
+	            !cowlo_slotchunk(cowdev, mapnum, mc, 0) ) {
+		/*
+		** zero chunk replaced: no block has a slot yet
+		*/
+		kfree(mc);
+		up(&cowdev->mapsem);
+		return NULL;
+	}
+
+	if (mc != (char *)zerochunk)
+		cowdev->mapbytes += numbytes;
+
+	/*
+	** the chunk contents must be visible before the pointer
+	*/
+	smp_wmb();
+	*(cowdev->mapcache+mapnum) = mc;
+
+	up(&cowdev->mapsem);
+	return mc;
+}
+
+/*
+** get all bitmap chunks in memory for the blocks 'first' upto 'last'
+** (writable: private chunks are needed to set bits)
+**
+** returns:
+** 	0   - fail
+**      1   - success
+*/
+static int
+cowlo_loadmap(struct cowloop_device *cowdev, unsigned long long first,
+				unsigned long long last, int writable)
+{
+	unsigned long	mapnum;
+
+	if (first >= last)
+		return 1;
+
+	for (mapnum = CALCMAP(first); mapnum <= CALCMAP(last-1) &&
+	                              mapnum < cowdev->mapcount; mapnum++) {
+		if (cowlo_mapchunk(cowdev, mapnum, writable) == NULL)
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+** check without sleeping if the bitmap chunks for the blocks
+** 'first' upto 'last' are in memory already
+*/
+static int
+cowlo_maploaded(struct cowloop_device *cowdev, unsigned long long first,
+						unsigned long long last)
+{
+	unsigned long	mapnum;
+
+	if (first >= last)
+		return 1;
+
+	for (mapnum = CALCMAP(first); mapnum <= CALCMAP(last-1) &&
+	                              mapnum < cowdev->mapcount; mapnum++) {
+		if (*(cowdev->mapcache+mapnum) == NULL)
+			return 0;
+	}
+
+	smp_read_barrier_depends();
+	return 1;
+}
+
+/*
+** get the slot map chunk of a dense cowfile that belongs to a bitmap
+** chunk that is being loaded; with 'load' the chunk is read from the
+** cowfile and the bits are set in the bitmap chunk 'mc' for the blocks
+** residing in the cowfile, otherwise no block has a slot yet
+**
+** returns:
+** 	0   - fail
+**      1   - success
+*/
+static int
+cowlo_slotchunk(struct cowloop_device *cowdev, unsigned long mapnum,
+						char *mc, int load)
+{
+	unsigned long	i, n = SLOTCHUNKN(cowdev, mapnum);
+	unsigned long	numbytes = SLOTCHUNKSZ(cowdev, mapnum);
+	unsigned int	*sc;
+
+	if ( (sc = vmalloc(numbytes)) == NULL) {
+		printk(KERN_ERR "cowloop - no space for slot map chunk %ld\n",
+								mapnum);
+		return 0;
+	}
+
+	memset(sc, 0, numbytes);
+
+	if (load) {
+		if (cowlo_readcowraw(cowdev, sc, numbytes,
+				SLOTCHUNKOFF(cowdev, mapnum)) < 0) {
+			vfree(sc);
+			return 0;
+		}
+
+		for (i=0; i < n; i++) {
+			if (sc[i << cowdev->slotshift] != COWNOSLOT)
+				*(mc+CALCBYTE(i)) |= (1<<CALCBIT(i));
+		}
+	}
+
+	*(cowdev->slotcache+mapnum) = sc;
+	cowdev->mapbytes += numbytes;
+
+	return 1;
+}
+
+/*
+** prepare the administration of the slots of a dense cowfile; the
+** entire slot map is scanned once to find out which slots are free
+**
+** returns:
+** 	0   - okay
+**    < 0   - error value
+*/
+static int
+cowlo_slotinit(struct cowloop_device *cowdev)
+{
+	unsigned long	i, j, n, slot, used = 0;
+	unsigned int	*sc;
+	size_t		bmsize;
+
+	if (cowdev->numblocks > COWMAXDENSE) {
+		printk(KERN_ERR
+		       "cowloop - rdofile too large for dense cowfile\n");
+		return -EFBIG;
+	}
+
+	/*
+	** allocate space to store all pointers for the slot map chunks
+	** (initialize area with zeroes to allow proper undo)
+	*/
+	cowdev->slotcache = kmalloc(cowdev->mapcount * sizeof(unsigned int *),
+								GFP_KERNEL);
+	if (!cowdev->slotcache) {
+		printk(KERN_ERR
+		       "cowloop - can not allocate space for slot map ptrs\n");
+		return -ENOMEM;
+	}
+
+	memset(cowdev->slotcache, 0, cowdev->mapcount * sizeof(unsigned int *));
+
+	/*
+	** every block uses at most one slot; besides, slots are pending
+	** for at most a quarter of the blocks (plus the slots of writes
+	** that are in progress)
+	*/
+	cowdev->maxslots  = cowdev->numblocks + cowdev->numblocks / 2 +
+							COWSLOTSPARE;
+	cowdev->slotshift = cowdev->cowhead->flags & COWCOMPRESS ? 1 : 0;
+
+	bmsize = BITS_TO_LONGS(cowdev->maxslots) * sizeof(unsigned long);
+
+	cowdev->slotused  = vmalloc(bmsize);
+	cowdev->slotpend  = vmalloc(bmsize);
+	cowdev->slotstage = vmalloc(bmsize);
+
+	if (!cowdev->slotused || !cowdev->slotpend || !cowdev->slotstage) {
+		printk(KERN_ERR
+		       "cowloop - can not allocate space for slot admin\n");
+		return -ENOMEM;
+	}
+
+	/*
+	** the slots of a deduplicated cowfile might be shared
+	*/
+	if (cowdev->cowhead->flags & COWDEDUP) {
+		cowdev->slotrefs = vmalloc(cowdev->maxslots *
+						sizeof(unsigned int));
+		if (!cowdev->slotrefs) {
+			printk(KERN_ERR "cowloop - can not allocate space "
+			                "for slot references\n");
+			return -ENOMEM;
+		}
+
+		memset(cowdev->slotrefs, 0, cowdev->maxslots *
+						sizeof(unsigned int));
+
+		cowdev->slothash = vmalloc(cowdev->maxslots * sizeof(u32));
+		if (!cowdev->slothash) {
+			printk(KERN_ERR "cowloop - can not allocate space "
+			                "for slot references\n");
+			return -ENOMEM;
+		}
+
+		memset(cowdev->slothash, 0, cowdev->maxslots * sizeof(u32));
+	}
+
+	memset(cowdev->slotused,  0, bmsize);
+	memset(cowdev->slotpend,  0, bmsize);
+	memset(cowdev->slotstage, 0, bmsize);
+
+	cowdev->nextslot   = cowdev->cowhead->nextslot;
+	cowdev->slotcursor = 1;
+	cowdev->pendslots  = 0;
+	cowdev->pendlo     = cowdev->stagelo = cowdev->maxslots;
+	cowdev->pendhi     = cowdev->stagehi = 0;
+
+	if (cowdev->nextslot < 1 || cowdev->nextslot > cowdev->maxslots) {
+		printk(KERN_ERR "cowloop - slot map of cowfile %s corrupt\n",
+							cowdev->cowname);
+		return -EINVAL;
+	}
+
+	__set_bit(COWNOSLOT, cowdev->slotused);	/* never allocated */
+
+	if ( (sc = vmalloc((MAPCHUNKBITS << cowdev->slotshift) *
+					sizeof(unsigned int))) == NULL) {
+		printk(KERN_ERR "cowloop - cannot get space for slot map\n");
+		return -ENOMEM;
+	}
+
+	/*
+	** register the slots in use (and count the blocks in the
+	** cowfile, because the cowhead might not be up-to-date)
+	*/
+	for (i=0, cowdev->nrcowblocks=0; i < cowdev->mapcount; i++) {
+		n = SLOTCHUNKN(cowdev, i);
+
+		if (cowlo_readcowraw(cowdev, sc, SLOTCHUNKSZ(cowdev, i),
+					SLOTCHUNKOFF(cowdev, i)) < 0) {
+			vfree(sc);
+			return -EIO;
+		}
+
+		for (j=0; j < n; j++) {
+			if ( (slot = sc[j << cowdev->slotshift]) == COWNOSLOT)
+				continue;
+
+			cowdev->nrcowblocks++;
+
+			if (slot == COWZEROSLOT)
+				continue;
+
+			if (slot < cowdev->maxslots && cowdev->slotrefs &&
+			    (*(cowdev->slotrefs + slot))++ > 0)
+				continue;		/* shared slot */
+
+			if (slot >= cowdev->maxslots ||
+			    __test_and_set_bit(slot, cowdev->slotused)) {
+				printk(KERN_ERR
+				       "cowloop - slot map of cowfile %s "
+				       "corrupt (block %lu)\n", cowdev->cowname,
+				       i * MAPCHUNKBITS + j);
+				vfree(sc);
+				return -EINVAL;
+			}
+
+			/*
+			** the slot map might have reached the disk before
+			** the cowhead with the new first unused slot
+			*/
+			if (slot >= cowdev->nextslot)
+				cowdev->nextslot = slot + 1;
+
+			used++;
+		}
+	}
+
+	vfree(sc);
+
+	cowdev->freeslots = cowdev->nextslot - 1 - used;
+
+	return 0;
+}
+
+/*
+** get the slot number of a block from the slot map in memory
+*/
+static unsigned long
+cowlo_slotget(struct cowloop_device *cowdev, unsigned long long blocknum)
+{
+	unsigned int	*sc = *(cowdev->slotcache+CALCMAP(blocknum));
+
+	return sc ? sc[(blocknum & (MAPCHUNKBITS-1)) << cowdev->slotshift] :
+								COWNOSLOT;
+}
+
+/*
+** allocate a slot: free slots are reused in sequence (next fit) before
+** the cowfile grows, so blocks written in sequence get adjacent slots;
+** a slot to relocate a block that has a slot already ('relocate') is
+** refused when too many slots are pending
+**
+** returns:
+**	COWNOSLOT - no slot available
+**	otherwise - slot number
+*/
+static unsigned long
+cowlo_slotalloc(struct cowloop_device *cowdev, int relocate)
+{
+	unsigned long	slot;
+
+	spin_lock(&cowdev->slotlock);
+
+	if (relocate && cowdev->pendslots >= (cowdev->numblocks >> 2)) {
+		spin_unlock(&cowdev->slotlock);
+		return COWNOSLOT;
+	}
+
+	if (cowdev->freeslots) {
+		slot = find_next_zero_bit(cowdev->slotused, cowdev->nextslot,
+							cowdev->slotcursor);
+		if (slot >= cowdev->nextslot)
+			slot = find_next_zero_bit(cowdev->slotused,
+						cowdev->nextslot, 1);
+		cowdev->freeslots--;
+	} else if (cowdev->nextslot < cowdev->maxslots) {
+		slot = cowdev->nextslot++;
+	} else {
+		spin_unlock(&cowdev->slotlock);
+		return COWNOSLOT;
+	}
+
+	__set_bit(slot, cowdev->slotused);
+	cowdev->slotcursor = slot + 1;
+
+	if (cowdev->slotrefs)
+		*(cowdev->slotrefs + slot) = 1;
+
+	spin_unlock(&cowdev->slotlock);
+
+	return slot;
+}
+
+/*
+** free a slot that is no longer referred to by the slot map in memory;
+** with 'pend' the slot map in the cowfile might still refer to it, so
+** it can only be reused after the slot map has been flushed and the
+** cowfile has been synced (otherwise the slot has just been allocated
+** and is free at once)
+**
+** a shared slot of a deduplicated cowfile only loses a reference;
+** a slot that loses its last reference leaves the dedup index
+*/
+static void
+cowlo_slotfree(struct cowloop_device *cowdev, unsigned long slot, int pend)
+{
+	struct cowlo_dedup	*dd;
+
+	spin_lock(&cowdev->slotlock);
+
+	if (cowdev->slotrefs && --(*(cowdev->slotrefs + slot)) > 0) {
+		spin_unlock(&cowdev->slotlock);
+		return;
+	}
+
+	if (cowdev->deduptab) {
+		dd = cowdev->deduptab + (*(cowdev->slothash + slot) &
+						(cowdev->dedupsize - 1));
+		if (dd->slot == slot)
+			dd->slot = COWNOSLOT;
+	}
+
+	if (pend) {
+		__set_bit(slot, cowdev->slotpend);
+		cowdev->pendslots++;
+
+		if (slot < cowdev->pendlo)
+			cowdev->pendlo = slot;
+		if (slot > cowdev->pendhi)
+			cowdev->pendhi = slot;
+	} else {
+		__clear_bit(slot, cowdev->slotused);
+
+		if (slot == cowdev->nextslot - 1)
+			cowdev->nextslot--;
+		else
+			cowdev->freeslots++;
+	}
+
+	spin_unlock(&cowdev->slotlock);
+}
+
+/*
+** the slot map has been flushed: the pending slots can be released
+** by the next sync of the cowfile
+**
+** must be called with the cowsem held for write
+*/
+static void
+cowlo_slotstage(struct cowloop_device *cowdev)
+{
+	unsigned long	slot, *tmp;
+
+	spin_lock(&cowdev->slotlock);
+
+	if (cowdev->pendhi == 0) {		/* nothing pending */
+		spin_unlock(&cowdev->slotlock);
+		return;
+	}
+
+	if (cowdev->stagehi == 0) {
+		tmp			= cowdev->slotstage;
+		cowdev->slotstage	= cowdev->slotpend;
+		cowdev->slotpend	= tmp;
+		cowdev->stagelo		= cowdev->pendlo;
+		cowdev->stagehi		= cowdev->pendhi;
+	} else {
+		/*
+		** previous sync failed: add to the staged slots
+		*/
+		for (slot = find_next_bit(cowdev->slotpend, cowdev->pendhi+1,
+							cowdev->pendlo);
+		     slot <= cowdev->pendhi;
+		     slot = find_next_bit(cowdev->slotpend, cowdev->pendhi+1,
+							slot+1)) {
+			__clear_bit(slot, cowdev->slotpend);
+			__set_bit  (slot, cowdev->slotstage);
+		}
+
+		if (cowdev->pendlo < cowdev->stagelo)
+			cowdev->stagelo = cowdev->pendlo;
+		if (cowdev->pendhi > cowdev->stagehi)
+			cowdev->stagehi = cowdev->pendhi;
+	}
+
+	cowdev->pendlo = cowdev->maxslots;
+	cowdev->pendhi = 0;
+
+	spin_unlock(&cowdev->slotlock);
+}
+
+/*
+** the cowfile has been synced after the slot map was flushed: the
+** staged slots are free from now on
+*/
+static void
+cowlo_slotrelease(struct cowloop_device *cowdev)
+{
+	unsigned long	slot;
+
+	spin_lock(&cowdev->slotlock);
+
+	if (cowdev->stagehi == 0) {		/* nothing staged */
+		spin_unlock(&cowdev->slotlock);
+		return;
+	}
+
+	for (slot = find_next_bit(cowdev->slotstage, cowdev->stagehi+1,
+							cowdev->stagelo);
+	     slot <= cowdev->stagehi;
+	     slot = find_next_bit(cowdev->slotstage, cowdev->stagehi+1,
+							slot+1)) {
+		__clear_bit(slot, cowdev->slotstage);
+		__clear_bit(slot, cowdev->slotused);
+		cowdev->freeslots++;
+		cowdev->pendslots--;
+	}
+
+	cowdev->stagelo = cowdev->maxslots;
+	cowdev->stagehi = 0;
+
+	spin_unlock(&cowdev->slotlock);
+}
+
+/*
+** fill a slot with binary zeroes
+**
+** returns:
+** 	0   - fail
+**      1   - success
+*/
+static int
+cowlo_slotclear(struct cowloop_device *cowdev, unsigned long slot)
+{
+	unsigned long	done;
+
+	for (done=0; done < cowdev->mapunit; done += MAPUNIT) {
+		if (cowlo_writecowraw(cowdev, allzeroes, MAPUNIT,
+				SLOTOFF(cowdev, slot) + done) < MAPUNIT)
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+** let the blocks 'first' upto 'last' of a dense cowfile read as binary
+** zeroes: their slots are freed (or filled with zeroes when too many
+** slots are pending already, unless the slots are never overwritten)
+**
+** must be called with the range locked and the chunks loaded
+*/
+static void
+cowlo_slotzero(struct cowloop_device *cowdev, unsigned long long first,
+						unsigned long long last)
+{
+	unsigned long long	blocknum;
+	unsigned long		slot;
+
+	for (blocknum = first; blocknum < last; blocknum++) {
+		slot = *SLOTP(cowdev, blocknum);
+
+		if (slot == COWZEROSLOT)
+			continue;
+
+		if ( SLOTREAL(slot) ) {
+			if (cowdev->pendslots >= (cowdev->numblocks >> 2) &&
+			    !(cowdev->cowhead->flags & COWBLOCKIO)    &&
+			    cowlo_slotclear(cowdev, slot))
+				continue;
+
+			cowlo_slotfree(cowdev, slot, 1);
+		}
+
+		spin_lock(&cowdev->slotlock);
+
+		*SLOTP(cowdev, blocknum) = COWZEROSLOT;
+
+		if (cowdev->slotshift)
+			*SLOTLEN(cowdev, blocknum) = 0;
+
+		spin_unlock(&cowdev->slotlock);
+
+		set_bit(CALCMAP(blocknum), cowdev->mapdirty);
+	}
+}
+
+/*
+** determine the slot to transfer the part of a block to, that belongs
+** to the request [offset, offset+len) of a dense cowfile:
+** - a read uses the current slot of the block (if any)
+** - a write to a block without slot gets a new slot (cleared when the
+**   block is not written entirely)
+** - a block that is written entirely gets a new slot as well, so
+**   overwrites are appended to the cowfile, unless too many slots
+**   are pending: then (as partial writes) it is written in place
+**
+** returns:
+**	COWNOSLOT   - no slot (fail for writes)
+**	COWZEROSLOT - block reads as binary zeroes
+**	otherwise   - slot number
+*/
+static unsigned long
+cowlo_slottarget(struct cowloop_device *cowdev, unsigned long long blocknum,
+					int len, loff_t offset, int rw)
+{
+	unsigned long	slot, cur = cowlo_slotget(cowdev, blocknum);
+	loff_t		start = (loff_t)blocknum << cowdev->mushift;
+	int		whole = start >= offset &&
+			        start + cowdev->mapunit <= offset + len;
+
+	if (rw == READ)
+		return cur;
+
+	if ( !SLOTREAL(cur) ) {
+		slot = cowlo_slotalloc(cowdev, 0);
+
+		if (slot == COWNOSLOT) {
+			printk(KERN_ERR "cowloop - no free slot in cowfile %s\n",
+							cowdev->cowname);
+			return COWNOSLOT;
+		}
+
+		if (!whole && !cowlo_slotclear(cowdev, slot)) {
+			cowlo_slotfree(cowdev, slot, 0);
+			return COWNOSLOT;
+		}
+
+		return slot;
+	}
+
+	if (whole && (slot = cowlo_slotalloc(cowdev, 1)) != COWNOSLOT)
+		return slot;
+
+	return cur;
+}
+
+/*
+** transfer data between a segmented data area and the slots of the
+** blocks of a dense cowfile (offset relative to the cowdevice)
+**
+** the blocks are gathered into runs of adjacent slots, so that every
+** run is transferred with one (vectored) read or write; after a write,
+** the slot map in memory refers to the new slots and the old slots
+** are freed (writes must be called with the range locked)
+**
+** return-value: similar to user-mode read/write
+*/
+static long int
+cowlo_slotio(struct cowloop_device *cowdev, const struct iovec *iov,
+				int nriov, int len, loff_t offset, int rw)
+{
+	unsigned long long	first, last, blocknum, runfirst, b;
+	unsigned long		slot, runslot, cur;
+	loff_t			start, end, pos;
+	struct cowlo_vec	vec;
+	long int		rv = len, n;
+	int			nr;
+
+	if (cowdev->cowhead->flags & COWBLOCKIO)
+		return cowlo_compio(cowdev, iov, nriov, len, offset, rw);
+
+	first = offset >> cowdev->mushift;
+	last  = (offset + len + cowdev->mumask) >> cowdev->mushift;
+
+	vec.iov   = (struct iovec *)iov;
+	vec.nriov = nriov;
+	vec.nrio  = 0;
+
+	if ( (vec.tmp = kmalloc(nriov * sizeof(struct iovec), GFP_NOIO)) == NULL)
+		return -ENOMEM;
+
+	slot = cowlo_slottarget(cowdev, first, len, offset, rw);
+
+	if (rw == WRITE && slot == COWNOSLOT)
+		rv = -ENOSPC;
+
+	for (blocknum = first; blocknum < last && rv > 0;) {
+		runfirst = blocknum;
+		runslot  = slot;
+
+		/*
+		** extend the run as long as the slots are adjacent
+		** (or the blocks read as binary zeroes)
+		*/
+		for (blocknum++; blocknum < last; blocknum++) {
+			slot = cowlo_slottarget(cowdev, blocknum, len, offset, rw);
+
+			if (rw == WRITE && slot == COWNOSLOT) {
+				rv = -ENOSPC;
+				break;
+			}
+
+			if ( SLOTREAL(runslot) ?
+			     slot != runslot + (blocknum - runfirst) :
+			     SLOTREAL(slot) )
+				break;
+		}
+
+		start = (loff_t)runfirst << cowdev->mushift;
+		end   = (loff_t)blocknum << cowdev->mushift;
+
+		if (start < offset)
+			start = offset;
+		if (end > offset + len)
+			end = offset + len;
+
+		if (rv > 0 && !SLOTREAL(runslot)) {
+			cowlo_iovclear(iov, nriov, start - offset, end - start);
+		} else if (rv > 0) {
+			nr  = cowlo_iovslice(&vec, start - offset, end - start,
+								vec.tmp);
+			pos = SLOTOFF(cowdev, runslot) +
+			      (start & cowdev->mumask);
+
+			if (rw == READ)
+				n = cowlo_readcowrawv(cowdev, vec.tmp, nr,
+							end - start, pos);
+			else
+				n = cowlo_writecowrawv(cowdev, vec.tmp, nr,
+							end - start, pos);
+
+			if (n < end - start)
+				rv = n < 0 ? n : -EIO;
+			else
+				cowlo_dropcache(cowdev, cowdev->cowfp,
+					end - start, pos, rw == WRITE);
+		}
+
+		if (rw == READ)
+			continue;
+
+		/*
+		** let the slot map refer to the written slots; when the
+		** write failed, the new slots are not used after all
+		*/
+		for (b = runfirst; b < blocknum; b++) {
+			slot = runslot + (b - runfirst);
+
+			if ( (cur = *SLOTP(cowdev, b)) == slot)
+				continue;
+
+			if (rv < 0) {
+				cowlo_slotfree(cowdev, slot, 0);
+				continue;
+			}
+
+			*SLOTP(cowdev, b) = slot;
+			set_bit(CALCMAP(b), cowdev->mapdirty);
+
+			if ( SLOTREAL(cur) )
+				cowlo_slotfree(cowdev, cur, 1);
+		}
+	}
+
+	/*
+	** a new slot might have been taken for the block following
+	** a failed run
+	*/
+	if (rw == WRITE && rv < 0 && blocknum < last && SLOTREAL(slot) &&
+	    slot != *SLOTP(cowdev, blocknum))
+		cowlo_slotfree(cowdev, slot, 0);
+
+	kfree(vec.tmp);
+
+	return rv;
+}
+
+/*
+** prepare the compression of the blocks of a compressed cowfile:
+** every kernel-thread (and I/O-thread) gets a compression context
+** of its own when needed, including the buffers for one block
+** (the contexts are used to deduplicate blocks as well)
+**
+** returns:
+** 	0   - okay
+**    < 0   - error value
+*/
+static int
+cowlo_compinit(struct cowloop_device *cowdev)
+{
+	struct cowlo_comp	*comp;
+	int			i, rv;
+
+	cowdev->nrcomp = nrthreads +
+			 (cowdev->pairflags & PAIRAIO ? aiothreads : 0);
+
+	cowdev->comp = kmalloc(cowdev->nrcomp * sizeof(struct cowlo_comp),
+								GFP_KERNEL);
+	if (!cowdev->comp) {
+		printk(KERN_ERR
+		       "cowloop - cannot get space for compression\n");
+		return -ENOMEM;
+	}
+
+	memset(cowdev->comp, 0, cowdev->nrcomp * sizeof(struct cowlo_comp));
+
+	for (i=0; i < cowdev->nrcomp; i++) {
+		comp = cowdev->comp + i;
+
+		if (cowdev->cowhead->flags & COWCOMPRESS) {
+			comp->tfm = crypto_alloc_comp(COWCOMPALG, 0, 0);
+
+			if ( IS_ERR(comp->tfm) ) {
+				printk(KERN_ERR "cowloop - compression %s "
+				                "not available\n", COWCOMPALG);
+				rv = PTR_ERR(comp->tfm);
+				comp->tfm = NULL;
+				return rv;
+			}
+		}
+
+		comp->blockbuf = vmalloc(cowdev->mapunit);
+		comp->compbuf  = vmalloc(COWCOMPBUFSZ(cowdev));
+
+		if (cowdev->cowhead->flags & COWDEDUP)
+			comp->dedupbuf = vmalloc(COWCOMPBUFSZ(cowdev));
+
+		if (!comp->blockbuf || !comp->compbuf ||
+		    (!comp->dedupbuf && (cowdev->cowhead->flags & COWDEDUP))) {
+			printk(KERN_ERR
+			       "cowloop - cannot get space for compression\n");
+			return -ENOMEM;
+		}
+
+		comp->next	= cowdev->compfree;
+		cowdev->compfree= comp;
+	}
+
+	sema_init(&cowdev->compsem, cowdev->nrcomp);
+
+	return 0;
+}
+
+/*
+** get a free compression context (waits until available)
+*/
+static struct cowlo_comp *
+cowlo_compget(struct cowloop_device *cowdev)
+{
+	struct cowlo_comp	*comp;
 
-				rv = cowlo_writecow(cowdev, req->buffer,
-								len, offset);
-				break;
-			}
+	down(&cowdev->compsem);
 
-	   	   case MIXEDUP:
-			rv = cowlo_writemix(cowdev, req->buffer, len, offset);
-			break;
+	spin_lock(&cowdev->complock);
+	comp		 = cowdev->compfree;
+	cowdev->compfree = comp->next;
+	spin_unlock(&cowdev->complock);
 
-		   default:
-			rv = 0;	/* never happens */
-		}
-		break;
+	return comp;
+}
 
-	   default:
-		printk(KERN_ERR
-		       "cowloop - unrecognized command %d\n", *(req->cmd));
-		rv = 0;
-	}
+static void
+cowlo_compput(struct cowloop_device *cowdev, struct cowlo_comp *comp)
+{
+	spin_lock(&cowdev->complock);
+	comp->next	 = cowdev->compfree;
+	cowdev->compfree = comp;
+	spin_unlock(&cowdev->complock);
 
-	return (rv <= 0 ? 0 : 1);
+	up(&cowdev->compsem);
 }
 
 /*
-** check for a given I/O-request if all underlying blocks 
-** (with size MAPUNIT) are either in the read-only file or in
-** the cowfile (or a combination of the two)
+** read a block from its slot in a compressed cowfile into the block
+** buffer of the compression context; only the compressed data is read
 **
 ** returns:
-** 	ALLRDO  - all underlying blocks in rdofile
-**      ALLCOW  - all underlying blocks in cowfile
-**      MIXEDUP - underlying blocks partly in rdofile and partly in cowfile
+** 	0   - fail
+**      1   - success
 */
 static int
-cowlo_checkio(struct cowloop_device *cowdev, int len, loff_t offset)
+cowlo_compread(struct cowloop_device *cowdev, struct cowlo_comp *comp,
+					unsigned long long blocknum)
 {
-	unsigned long	mapnum, bytenum, bitnum, blocknr, partlen;
-	long int	totcnt, cowcnt;
-	char		*mc;
+	unsigned long	slot;
+	unsigned int	clen, dlen;
+	loff_t		pos;
 
 	/*
-	** notice that the requested block might cross
-	** a blocksize boundary while one of the concerned
-	** blocks resides in the read-only file and another
-	** one in the copy-on-write file; in that case the
-        ** request will be broken up into pieces
+	** the slot and the length are modified together by writes
 	*/
-	if ( (len <= MAPUNIT) &&
-	     (MAPUNIT - (offset & MUMASK) <= len) ) {
-		/*
-		** easy situation:
-		** requested data-block entirely fits within
-		** the mapunit used for the bitmap
-		** check if that block is located in rdofile or
-		** cowfile
-		*/
-		blocknr = offset >> MUSHIFT;
+	spin_lock(&cowdev->slotlock);
+	slot = *SLOTP(cowdev, blocknum);
+	clen = cowdev->slotshift ? *SLOTLEN(cowdev, blocknum) : 0;
+	spin_unlock(&cowdev->slotlock);
+
+	if ( !SLOTREAL(slot) ) {
+		memset(comp->blockbuf, 0, cowdev->mapunit);
+		return 1;
+	}
 
-		mapnum  = CALCMAP (blocknr);
-		bytenum = CALCBYTE(blocknr);
-		bitnum  = CALCBIT (blocknr);
+	pos = SLOTOFF(cowdev, slot);
 
-		if (*(*(cowdev->mapcache+mapnum)+bytenum)&(1<<bitnum))
-			return ALLCOW;
-		else
-			return ALLRDO;
+	if (clen == 0) {		/* stored uncompressed */
+		if (cowlo_readcowraw(cowdev, comp->blockbuf, cowdev->mapunit,
+						pos) < cowdev->mapunit)
+			return 0;
+
+		cowlo_dropcache(cowdev, cowdev->cowfp, cowdev->mapunit, pos, 0);
+		return 1;
 	}
 
-	/*
-	** less easy situation:
-	** the requested data-block does not fit within the mapunit
-	** used for the bitmap
-	** check if *all* underlying blocks involved reside on the rdofile
-       	** or the cowfile (so still no breakup required)
-	*/
-	for (cowcnt=totcnt=0; len > 0; len-=partlen, offset+=partlen, totcnt++){
+	if (clen >= cowdev->mapunit ||
+	    cowlo_readcowraw(cowdev, comp->compbuf, clen, pos) < clen)
+		return 0;
+
+	cowlo_dropcache(cowdev, cowdev->cowfp, clen, pos, 0);
+
+	dlen = cowdev->mapunit;
+
+	if (crypto_comp_decompress(comp->tfm, comp->compbuf, clen,
+					comp->blockbuf, &dlen) ||
+	    dlen != cowdev->mapunit) {
+		printk(KERN_ERR
+		       "cowloop - corrupt compressed block %llu in cowfile %s\n",
+			blocknum, cowdev->cowname);
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+** transfer data between a segmented data area and the blocks of a
+** compressed and/or deduplicated cowfile (offset relative to the
+** cowdevice)
+**
+** every block is handled as a whole: a block that is written partly
+** is completed with its current contents first; the (compressed) data
+** is always written to a new slot, so the slot map in the cowfile
+** keeps referring to data of the length registered with it and a
+** shared slot is never modified; a block with the same contents as
+** a slot found in the dedup index refers to that slot instead
+**
+** return-value: similar to user-mode read/write
+*/
+static long int
+cowlo_compio(struct cowloop_device *cowdev, const struct iovec *iov,
+				int nriov, int len, loff_t offset, int rw)
+{
+	unsigned long long	blocknum, last;
+	unsigned long		slot, cur;
+	unsigned int		clen, wlen;
+	loff_t			start, end;
+	struct cowlo_comp	*comp;
+	long int		rv = len;
+	char			*wbuf;
+	u32			hash = 0;
+
+	last = (offset + len + cowdev->mumask) >> cowdev->mushift;
+	comp = cowlo_compget(cowdev);
+
+	for (blocknum = offset >> cowdev->mushift;
+	     blocknum < last && rv > 0; blocknum++) {
+		start = (loff_t)blocknum << cowdev->mushift;
+		end   = start + cowdev->mapunit;
+
+		if (start < offset)
+			start = offset;
+		if (end > offset + len)
+			end = offset + len;
+
+		cur = cowlo_slotget(cowdev, blocknum);
+
+		if (rw == READ) {
+			if ( !SLOTREAL(cur) ) {
+				cowlo_iovclear(iov, nriov, start - offset,
+							end - start);
+				continue;
+			}
+
+			if ( !cowlo_compread(cowdev, comp, blocknum) ) {
+				rv = -EIO;
+				break;
+			}
+
+			cowlo_iovput(iov, nriov, start - offset,
+				comp->blockbuf + (start & cowdev->mumask),
+				end - start);
+			continue;
+		}
+
 		/*
-		** calculate blocknr of involved block
+		** build the entire block to be written
 		*/
-		blocknr = offset >> MUSHIFT;
+		if (end - start < cowdev->mapunit &&
+		    !cowlo_compread(cowdev, comp, blocknum)) {
+			rv = -EIO;
+			break;
+		}
+
+		cowlo_iovget(iov, nriov, start - offset,
+				comp->blockbuf + (start & cowdev->mumask),
+				end - start);
 
 		/*
-		** calculate partial length for this transfer
+		** a block of binary zeroes needs no slot at all; a block
+		** that does not get smaller (in filesystem blocks) is
+		** stored uncompressed
 		*/
-		partlen = MAPUNIT - (offset & MUMASK);
-		if (partlen > len)
-			partlen = len;
+		clen = 0;
+		slot = COWNOSLOT;
+
+		if ( cowlo_iszero(comp->blockbuf, cowdev->mapunit) ) {
+			slot = COWZEROSLOT;
+		} else {
+			clen = COWCOMPBUFSZ(cowdev);
+
+			if ( !(cowdev->cowhead->flags & COWCOMPRESS) ||
+			    crypto_comp_compress(comp->tfm, comp->blockbuf,
+				cowdev->mapunit, comp->compbuf, &clen) ||
+			    COWCOMPDISK(cowdev, clen) >= cowdev->mapunit)
+				clen = 0;
+
+			wbuf = clen ? comp->compbuf : comp->blockbuf;
+			wlen = clen ? clen : cowdev->mapunit;
+
+			if (cowdev->cowhead->flags & COWDEDUP) {
+				hash = jhash2((u32 *)comp->blockbuf,
+					cowdev->mapunit / sizeof(u32), 0);
+				slot = cowlo_dedupfind(cowdev, comp, hash,
+							wbuf, wlen, clen);
+			}
+		}
+
+		if (slot == COWNOSLOT) {
+			if ( (slot = cowlo_slotalloc(cowdev, 0)) == COWNOSLOT) {
+				printk(KERN_ERR
+				       "cowloop - no free slot in cowfile %s\n",
+					cowdev->cowname);
+				rv = -ENOSPC;
+				break;
+			}
+
+			if (cowlo_writecowraw(cowdev, wbuf, wlen,
+					SLOTOFF(cowdev, slot)) < wlen) {
+				cowlo_slotfree(cowdev, slot, 0);
+				rv = -EIO;
+				break;
+			}
+
+			cowlo_dropcache(cowdev, cowdev->cowfp, wlen,
+						SLOTOFF(cowdev, slot), 1);
+
+			if (clen) {
+				cowdev->compwrites++;
+				cowdev->compsaved += cowdev->mapunit -
+						COWCOMPDISK(cowdev, clen);
+			}
+
+			if (cowdev->cowhead->flags & COWDEDUP)
+				cowlo_dedupadd(cowdev, hash, slot, clen);
+		}
 
 		/*
-		** is this block located in the cowfile
+		** a block found with its own slot has got an additional
+		** reference, which is dropped right away
 		*/
-		mapnum  = CALCMAP (blocknr);
-		bytenum = CALCBYTE(blocknr);
-		bitnum  = CALCBIT (blocknr);
+		if (slot == cur) {
+			if ( SLOTREAL(cur) )
+				cowlo_slotfree(cowdev, cur, 1);
+			continue;
+		}
 
-		mc	= *(cowdev->mapcache+mapnum);
+		spin_lock(&cowdev->slotlock);
+		*SLOTP(cowdev, blocknum) = slot;
 
-		if (*(mc+bytenum)&(1<<bitnum))
-			cowcnt++;;
+		if (cowdev->slotshift)
+			*SLOTLEN(cowdev, blocknum) = clen;
+		spin_unlock(&cowdev->slotlock);
 
-		DEBUGP(DCOW
-		       "cowloop - check %lu - map %lu, byte %lu, bit %lu, "
-		       "cowcnt %ld, totcnt %ld %02x %p\n",
-			blocknr, mapnum, bytenum, bitnum, cowcnt, totcnt,
-			*(mc+bytenum), mc);
+		set_bit(CALCMAP(blocknum), cowdev->mapdirty);
+
+		if ( SLOTREAL(cur) )
+			cowlo_slotfree(cowdev, cur, 1);
+	}
+
+	cowlo_compput(cowdev, comp);
+
+	return rv;
+}
+
+/*
+** the slots of a compressed or deduplicated cowfile are never
+** overwritten, so the pending slots are released by a commit once
+** there are many of them (must be called without the cowsem held)
+*/
+static void
+cowlo_slotreclaim(struct cowloop_device *cowdev)
+{
+	if ( (cowdev->cowhead->flags & COWBLOCKIO) &&
+	     cowdev->pendslots >= (cowdev->numblocks >> 2) )
+		cowlo_commit(cowdev);
+}
+
+/*
+** prepare the index of the contents of the slots of a deduplicated
+** cowfile: a table (in memory only) with one entry per hash value
+** of a block, in which a newer slot replaces an older one; the index
+** is filled by the blocks written since the cowfile has been opened
+**
+** returns:
+** 	0   - okay
+**    < 0   - error value
+*/
+static int
+cowlo_dedupinit(struct cowloop_device *cowdev)
+{
+	for (cowdev->dedupsize = 1;
+	     cowdev->dedupsize < cowdev->numblocks &&
+	     cowdev->dedupsize < COWDEDUPMAX; cowdev->dedupsize <<= 1)
+		;
+
+	cowdev->deduptab = vmalloc(cowdev->dedupsize *
+					sizeof(struct cowlo_dedup));
+	if (!cowdev->deduptab) {
+		printk(KERN_ERR
+		       "cowloop - cannot get space for dedup index\n");
+		return -ENOMEM;
+	}
+
+	memset(cowdev->deduptab, 0, cowdev->dedupsize *
+					sizeof(struct cowlo_dedup));
+	return 0;
+}
+
+/*
+** find a slot that contains the same data as the data to be written
+** for a block ('wbuf' of 'wlen' bytes, stored with length 'clen'); the
+** data in the slot is compared, so a hash collision does no harm
+**
+** returns:
+**	COWNOSLOT - no such slot
+**	otherwise - slot number (with an additional reference)
+*/
+static unsigned long
+cowlo_dedupfind(struct cowloop_device *cowdev, struct cowlo_comp *comp,
+		u32 hash, const char *wbuf, unsigned int wlen, unsigned int clen)
+{
+	struct cowlo_dedup	dd;
+
+	cowdev->deduplookups++;
+
+	/*
+	** a reference is taken before the slot is read: a slot with a
+	** reference is never overwritten, freed or reused
+	*/
+	spin_lock(&cowdev->slotlock);
+
+	dd = *(cowdev->deduptab + (hash & (cowdev->dedupsize - 1)));
+
+	if (dd.slot == COWNOSLOT || dd.hash != hash || dd.clen != clen ||
+	    *(cowdev->slotrefs + dd.slot) == 0) {
+		spin_unlock(&cowdev->slotlock);
+		return COWNOSLOT;
 	}
 
-	if (cowcnt == 0)	/* all involved blocks on rdofile? */
-		return ALLRDO;
+	(*(cowdev->slotrefs + dd.slot))++;
 
-	if (cowcnt == totcnt)	/* all involved blocks on cowfile? */
-		return ALLCOW;
+	spin_unlock(&cowdev->slotlock);
 
 	/*
-	** situation somewhat more complicated:
-	** involved underlying blocks spread over both files
+	** on a mismatch the reference is dropped again (the slot map in
+	** the cowfile might refer to the slot, so it is freed 'pending')
 	*/
-	return MIXEDUP;
+	if (cowlo_readcowraw(cowdev, comp->dedupbuf, wlen,
+			SLOTOFF(cowdev, dd.slot)) < wlen ||
+	    memcmp(comp->dedupbuf, wbuf, wlen) ) {
+		cowlo_slotfree(cowdev, dd.slot, 1);
+		return COWNOSLOT;
+	}
+
+	cowdev->deduphits++;
+	cowdev->dedupsaved += cowdev->mapunit;
+
+	return dd.slot;
+}
+
+/*
+** register the contents of a slot that has just been written
+*/
+static void
+cowlo_dedupadd(struct cowloop_device *cowdev, u32 hash,
+				unsigned long slot, unsigned int clen)
+{
+	struct cowlo_dedup	*dd;
+
+	dd = cowdev->deduptab + (hash & (cowdev->dedupsize - 1));
+
+	spin_lock(&cowdev->slotlock);
+	dd->hash = hash;
+	dd->slot = slot;
+	dd->clen = clen;
+	*(cowdev->slothash + slot) = hash;
+	spin_unlock(&cowdev->slotlock);
 }
 
 /*
@@ -1280,55 +4112,57 @@ cowlo_checkio(struct cowloop_device *cowdev, int len, loff_t offset)
 **      1   - success
 */
 static int
-cowlo_readmix(struct cowloop_device *cowdev, void *buf, int len, loff_t offset)
+cowlo_readmix(struct cowloop_device *cowdev, struct cowlo_vec *vec,
+						int len, loff_t offset)
 {
-	unsigned long	mapnum, bytenum, bitnum, blocknr, partlen;
+	unsigned long long	last, next;
+	unsigned long		partlen, done;
 	long int	rv;
-	char		*mc;
+	int		nr, incow;
+
+	last = (offset + len + cowdev->mumask) >> cowdev->mushift;
 
 	/*
 	** complicated approach: breakup required of read-request
+	** into extents of blocks that reside in the same file
 	*/
-	for (rv=1; len > 0; len-=partlen, buf+=partlen, offset+=partlen) {
-		/*
-		** calculate blocknr of entire block
-		*/
-		blocknr = offset >> MUSHIFT;
-
+	for (rv=1, done=0; len > 0; len-=partlen, done+=partlen,
+							offset+=partlen) {
 		/*
 		** calculate partial length for this transfer
 		*/
-		partlen = MAPUNIT - (offset & MUMASK);
+		next	= cowlo_mapextent(cowdev, offset >> cowdev->mushift,
+							last, &incow);
+
+		partlen	= ((loff_t)next << cowdev->mushift) - offset;
 		if (partlen > len)
 			partlen = len;
 
-		/*
-		** is this block located in the cowfile
-		*/
-		mapnum  = CALCMAP (blocknr);
-		bytenum = CALCBYTE(blocknr);
-		bitnum  = CALCBIT (blocknr);
-		mc	= *(cowdev->mapcache+mapnum);
+		nr	= cowlo_iovslice(vec, done, partlen, vec->tmp);
 
-		if (*(mc+bytenum)&(1<<bitnum)) {
+		if (incow) {
 			/*
-			** read (partial) block from cowfile
+			** read extent from cowfile
 			*/
 			DEBUGP(DCOW"cowloop - split read "
 				"cow partlen=%ld off=%lld\n", partlen, offset);
 
-			if (cowlo_readcow(cowdev, buf, partlen, offset) <= 0)
+			if (cowlo_readcowv(cowdev, vec->tmp, nr,
+						partlen, offset) <= 0)
 				rv = 0;
 		} else {
 			/*
-			** read (partial) block from rdofile
+			** read extent from rdofile
 			*/
 			DEBUGP(DCOW"cowloop - split read "
 				"rdo partlen=%ld off=%lld\n", partlen, offset);
 
-			if (cowlo_readrdo(cowdev, buf, partlen, offset) <= 0)
+			if (cowlo_readrdov(cowdev, vec->tmp, nr,
+						partlen, offset) <= 0)
 				rv = 0;
 		}
+
+		vec->nrio++;
 	}
 
 	return rv;
@@ -1343,119 +4177,422 @@ cowlo_readmix(struct cowloop_device *cowdev, void *buf, int len, loff_t offset)
 **      1   - success
 */
 static int
-cowlo_writemix(struct cowloop_device *cowdev, void *buf, int len, loff_t offset)
+cowlo_writemix(struct cowloop_device *cowdev, struct cowlo_vec *vec,
+						int len, loff_t offset)
 {
-	unsigned long	mapnum, bytenum, bitnum, blocknr, partlen;
+	unsigned long long	last, next;
+	unsigned long		partlen, done, head, tail;
 	long int	rv;
-	char		*mc;
+	int		nr, incow;
+	char		*iobuf = NULL, *headbuf, *tailbuf;
+
+	last = (offset + len + cowdev->mumask) >> cowdev->mushift;
 
 	/*
 	** somewhat more complicated stuff is required:
-	** if the request is larger than one underlying
-	** block or is spread over two underlying blocks,
-	** split the request into pieces; if a block does not
-	** start at a block boundary, take care that 
-	** surrounding data is read first (if needed),
-	** fit the new data in and write it as a full block
+	** split the request into extents of blocks that reside
+	** in the same file; blocks that have been written before
+	** are written transparently, just like blocks that are
+	** written for the first time and are entirely covered
+	**
+	** only the first and the last block of the request might
+	** be covered partially; if such block is written for the
+	** first time, the surrounding data of the block is read
+	** from the rdofile first and written to the cowfile together
+	** with the extent (one write for the entire extent)
 	*/
-	for (rv=1; len > 0; len-=partlen, buf+=partlen, offset+=partlen) {
+	for (rv=1, done=0; len > 0; len-=partlen, done+=partlen,
+							offset+=partlen) {
 		/*
 		** calculate partial length for this transfer
 		*/
-		partlen = MAPUNIT - (offset & MUMASK);
+		next	= cowlo_mapextent(cowdev, offset >> cowdev->mushift,
+							last, &incow);
+
+		partlen	= ((loff_t)next << cowdev->mushift) - offset;
 		if (partlen > len)
 			partlen = len;
 
+		if (incow) {
+			/*
+			** blocks have been written before;
+			** write transparantly to cowfile
+			*/
+			DEBUGP(DCOW
+			       "cowloop - splitwr transp\n");
+
+			nr = cowlo_iovslice(vec, done, partlen, vec->tmp);
+
+			if (cowlo_writecowv(cowdev, vec->tmp, nr,
+						partlen, offset) <= 0)
+				rv = 0;
+
+			vec->nrio++;
+			continue;
+		}
+
+		/*
+		** blocks have never been written before: determine
+		** which part of the first and last block is not covered
+		*/
+		head	= offset & cowdev->mumask;
+		tail	= (cowdev->mapunit - ((offset + partlen) &
+				cowdev->mumask)) & cowdev->mumask;
+
+		/*
+		** obtain a copy-up buffer if surrounding data is needed;
+		** when memory is short, this waits for a buffer that is
+		** released by another kernel-thread (or uses the reserve)
+		*/
+		if ( (head || tail) && !iobuf )
+			iobuf = mempool_alloc(cowdev->bufpool, GFP_NOIO);
+
+		headbuf = iobuf;
+		tailbuf = iobuf + cowdev->mapunit;
+
+		if ( head && tail &&
+		     (offset >> cowdev->mushift) ==
+		                 ((offset+partlen-1) >> cowdev->mushift) ) {
+			/*
+			** one block, covered in the middle:
+			** read entire block from read-only file
+			*/
+			if (cowlo_readrdo(cowdev, headbuf, cowdev->mapunit,
+							offset - head) <= 0)
+				rv = 0;
+
+			tailbuf = headbuf + head + partlen;
+			vec->nrio++;
+		} else {
+			/*
+			** read the uncovered part of the first block
+			** and of the last block from read-only file
+			*/
+			if (head) {
+				if (cowlo_readrdo(cowdev, headbuf, head,
+							offset - head) <= 0)
+					rv = 0;
+				vec->nrio++;
+			}
+
+			if (tail) {
+				if (cowlo_readrdo(cowdev, tailbuf, tail,
+							offset + partlen) <= 0)
+					rv = 0;
+				vec->nrio++;
+			}
+		}
+
 		/*
-		** calculate blocknr of entire block
+		** surrounding data of binary zeroes (e.g. from a sparse
+		** rdofile) does not have to be written when the blocks
+		** get a hole in the cowfile first: only the new data is
+		** written, so the unchanged parts cost no space
 		*/
-		blocknr = offset >> MUSHIFT;
+		if ( rv && (head || tail) && !cowdev->nopunch &&
+		     !(cowdev->cowhead->flags & COWDENSE) &&
+		     cowlo_iszero(headbuf, head) &&
+		     cowlo_iszero(tailbuf, tail) ) {
+			switch ( cowlo_punchcow(cowdev,
+			             (offset - head) >> cowdev->mushift,
+			             (offset + partlen + tail) >>
+			                                 cowdev->mushift) ) {
+			   case 0:
+				head = tail = 0;
+				cowdev->sparsecopies++;
+				break;
+
+			   case -EOPNOTSUPP:
+				cowdev->nopunch = 1;
+				break;
+			}
+		}
 
 		/*
-		** has this block been written before?
+		** write the new data surrounded by the data just
+		** read as entire blocks to the cowfile
 		*/
-		mapnum  = CALCMAP (blocknr);
-		bytenum = CALCBYTE(blocknr);
-		bitnum  = CALCBIT (blocknr);
-		mc	= *(cowdev->mapcache+mapnum);
+		nr = 0;
+
+		if (head) {
+			vec->tmp[nr].iov_base = headbuf;
+			vec->tmp[nr].iov_len  = head;
+			nr++;
+		}
+
+		nr += cowlo_iovslice(vec, done, partlen, vec->tmp+nr);
+
+		if (tail) {
+			vec->tmp[nr].iov_base = tailbuf;
+			vec->tmp[nr].iov_len  = tail;
+			nr++;
+		}
+
+		DEBUGP(DCOW"cowloop - split "
+			"partlen=%ld off=%lld\n",
+			head + partlen + tail, offset - head);
+
+		if (cowlo_writecowv(cowdev, vec->tmp, nr,
+				head + partlen + tail, offset - head) <= 0)
+			rv = 0;
+
+		vec->nrio++;
+	}
+
+	if (iobuf)
+		mempool_free(iobuf, cowdev->bufpool);
+
+	return rv;
+}
+
+/*****************************************************************************/
+/* I/O-support for read-only file and copy-on-write file                     */
+/*****************************************************************************/
+
+/*
+** read data from the read-only file into a single buffer
+**
+** return-value: similar to user-mode read
+*/
+static long int
+cowlo_readrdo(struct cowloop_device *cowdev, void *buf, int len, loff_t offset)
+{
+	struct iovec	iov = { buf, len };
+
+	return cowlo_readrdov(cowdev, &iov, 1, len, offset);
+}
+
+/*
+** read data from the read-only file into a vector of buffers
+**
+** return-value: similar to user-mode readv
+*/
+static long int
+cowlo_readrdov(struct cowloop_device *cowdev, const struct iovec *iov,
+					int nriov, int len, loff_t offset)
+{
+	long int		rv;
+	mm_segment_t		old_fs;
+	loff_t			saveoffset;
+	struct file		*fp = cowdev->rdofp;
+	unsigned long long	last;
+	int			owner = 0;
+
+	DEBUGP(DCOW"cowloop - readrdov called\n");
+
+	/*
+	** with lower cowfiles, the blocks might reside in several layers;
+	** otherwise the data area of the owning layer is read
+	*/
+	if (cowdev->layermap) {
+		last = (offset + len + cowdev->mumask) >> cowdev->mushift;
+
+		if (cowlo_layerextent(cowdev, offset >> cowdev->mushift,
+						last, &owner) < last)
+			return cowlo_readlayerv(cowdev, iov, nriov, len, offset);
+
+		if (owner) {
+			fp      = cowdev->layers[owner-1].fp;
+			offset += cowdev->layers[owner-1].doffset;
+		}
+	}
+
+	saveoffset = offset;
+
+	if (!owner)
+		cowlo_readahead(cowdev, len, offset);
+
+        old_fs = get_fs();
+	set_fs( get_ds() );
+	rv = vfs_readv(fp, (const struct iovec __user *)iov, nriov, &offset);
+        set_fs(old_fs);
+
+	if (rv < len) {
+		printk(KERN_WARNING "cowloop - read-failure %ld on %s"
+		                    "- offset=%lld len=%d\n", rv,
+				owner ? cowdev->layers[owner-1].name : "rdofile",
+				saveoffset, len);
+	}
+
+	cowlo_dropcache(cowdev, fp, len, saveoffset, 0);
+
+	if (owner)
+		cowdev->lowreads++;
+	else
+		cowdev->rdoreads++;
+
+	return rv;
+}
+
+/*
+** read data from the read-only file and the lower cowfiles into a
+** vector of buffers: one read per extent of blocks owned by one layer
+**
+** return-value: similar to user-mode readv
+*/
+static long int
+cowlo_readlayerv(struct cowloop_device *cowdev, const struct iovec *iov,
+					int nriov, int len, loff_t offset)
+{
+	unsigned long long	first, last, runfirst, blocknum;
+	loff_t			start, end;
+	struct cowlo_vec	vec;
+	long int		rv = len, n;
+	int			nr, owner;
+
+	first = offset >> cowdev->mushift;
+	last  = (offset + len + cowdev->mumask) >> cowdev->mushift;
+
+	vec.iov   = (struct iovec *)iov;
+	vec.nriov = nriov;
+	vec.nrio  = 0;
 
-		if (*(mc+bytenum)&(1<<bitnum)) {
-			/*
-			** block has been written before;
-			** write transparantly to cowfile
-			*/
-			DEBUGP(DCOW
-			       "cowloop - splitwr transp\n");
+	if ( (vec.tmp = kmalloc(nriov * sizeof(struct iovec), GFP_NOIO)) == NULL)
+		return -ENOMEM;
 
-			if (cowlo_writecow(cowdev, buf, partlen, offset) <= 0)
-				rv = 0;
-		} else {
-			/*
-			** block has never been written before,
-			** so read entire block from
-			** read-only file first, unless
-			** a full block is requested to
-			** be written
-			*/
-			if (partlen < MAPUNIT) {
-				if (cowlo_readrdo(cowdev, cowdev->iobuf,
-				      MAPUNIT, (loff_t)blocknr << MUSHIFT) <= 0)
-					rv = 0;
-			}
+	for (runfirst = first; runfirst < last; runfirst = blocknum) {
+		blocknum = cowlo_layerextent(cowdev, runfirst, last, &owner);
 
-			/*
-			** transfer modified part into
-			** the block just read
-			*/
-			memcpy(cowdev->iobuf + (offset & MUMASK), buf, partlen);
+		start = (loff_t)runfirst << cowdev->mushift;
+		end   = (loff_t)blocknum << cowdev->mushift;
 
-			/*
-			** write entire block to cowfile
-			*/
-			DEBUGP(DCOW"cowloop - split "
-				"partlen=%ld off=%lld\n",
-				partlen, (loff_t)blocknr << MUSHIFT);
+		if (start < offset)
+			start = offset;
+		if (end > offset + len)
+			end = offset + len;
 
-			if (cowlo_writecow(cowdev, cowdev->iobuf, MAPUNIT,
-					     (loff_t)blocknr << MUSHIFT) <= 0)
-				rv = 0;
+		nr = cowlo_iovslice(&vec, start - offset, end - start, vec.tmp);
+		n  = cowlo_readrdov(cowdev, vec.tmp, nr, end - start, start);
+
+		if (n < end - start) {
+			rv = n < 0 ? n : start - offset + n;
+			break;
 		}
 	}
 
+	kfree(vec.tmp);
 	return rv;
 }
 
-/*****************************************************************************/
-/* I/O-support for read-only file and copy-on-write file                     */
-/*****************************************************************************/
+/*
+** determine the extent of blocks, starting at block 'first' and
+** ending before block 'last', that are all owned by the same layer
+** (read-only file or one of the lower cowfiles)
+**
+** returns: block number directly following the extent
+**          (*owner set to the layer: 0 is the read-only file)
+*/
+static unsigned long long
+cowlo_layerextent(struct cowloop_device *cowdev, unsigned long long first,
+				unsigned long long last, int *owner)
+{
+	unsigned long long	blocknr;
+	unsigned char		*lc;
+
+	lc	= *(cowdev->layermap + CALCMAP(first));
+	*owner	= lc ? *(lc + (first & (MAPCHUNKBITS-1))) : 0;
+
+	for (blocknr = first; blocknr < last; blocknr++) {
+		lc = *(cowdev->layermap + CALCMAP(blocknr));
+
+		if (lc == NULL) {
+			if (*owner)
+				return blocknr;
+
+			blocknr |= MAPCHUNKBITS-1;	/* skip whole chunk */
+			continue;
+		}
+
+		if (*(lc + (blocknr & (MAPCHUNKBITS-1))) != *owner)
+			return blocknr;
+	}
+
+	return last;
+}
 
 /*
-** read data from the read-only file
+** read data from a lower cowfile outside the context of a request
 **
 ** return-value: similar to user-mode read
 */
 static long int
-cowlo_readrdo(struct cowloop_device *cowdev, void *buf, int len, loff_t offset)
+cowlo_readlayer(struct file *fp, void *buf, int len, loff_t offset)
 {
 	long int	rv;
 	mm_segment_t	old_fs;
-	loff_t		saveoffset = offset;
-
-	DEBUGP(DCOW"cowloop - readrdo called\n");
 
         old_fs = get_fs();
 	set_fs( get_ds() );
-	rv = cowdev->rdofp->f_op->read(cowdev->rdofp, buf, len, &offset);
+	rv = vfs_read(fp, (char __user *)buf, len, &offset);
         set_fs(old_fs);
 
-	if (rv < len) {
-		printk(KERN_WARNING "cowloop - read-failure %ld on rdofile"
-		                    "- offset=%lld len=%d\n",
-					rv, saveoffset, len);
+	return rv;
+}
+
+/*
+** keep track of a sequential stream of reads from the read-only file:
+** as long as the reads follow each other (or fall within the area
+** prefetched before), the next window of the read-only file is
+** prefetched into the page cache before less than half of the window
+** is left ahead of the current read
+*/
+static void
+cowlo_readahead(struct cowloop_device *cowdev, int len, loff_t offset)
+{
+	struct file_ra_state	ra;
+	loff_t			window, start = 0, end = 0;
+	int			hit;
+
+	window = (loff_t)readahead * 1024;
+
+	if (window <= 0 || window > (loff_t)MAXREADAHEAD * 1024)
+		return;			/* read-ahead off (or insane) */
+
+	spin_lock(&cowdev->ralock);
+
+	hit = offset >= cowdev->rastart && offset + len <= cowdev->raend;
+
+	if (hit)
+		cowdev->rahits++;
+	else
+		cowdev->ramisses++;
+
+	if ( (hit || offset == cowdev->ranext) &&
+	     offset + len + window / 2 > cowdev->raend ) {
+		start = offset + len;
+
+		if (start < cowdev->raend)
+			start = cowdev->raend;	/* extend prefetched area */
+		else
+			cowdev->rastart = start;
+
+		end = offset + len + window;
+
+		if (end > (loff_t)cowdev->rdosize)
+			end = (loff_t)cowdev->rdosize;
+
+		if (end > cowdev->raend)
+			cowdev->raend = end;
 	}
 
-	cowdev->rdoreads++;
-	return rv;
+	cowdev->ranext = offset + len;
+
+	spin_unlock(&cowdev->ralock);
+
+	if (start >= end)
+		return;
+
+	/*
+	** with a fresh read-ahead state, the kernel submits reads for
+	** exactly the given pages (those not yet cached) without
+	** waiting for them
+	*/
+	file_ra_state_init(&ra, cowdev->rdofp->f_mapping);
+	ra.ra_pages = window >> PAGE_CACHE_SHIFT;
+
+	page_cache_sync_readahead(cowdev->rdofp->f_mapping, &ra,
+		cowdev->rdofp, start >> PAGE_CACHE_SHIFT,
+		((end - 1) >> PAGE_CACHE_SHIFT) - (start >> PAGE_CACHE_SHIFT) + 1);
 }
 
 /*
@@ -1466,11 +4603,62 @@ cowlo_readrdo(struct cowloop_device *cowdev, void *buf, int len, loff_t offset)
 static long int
 cowlo_readcow(struct cowloop_device *cowdev, void *buf, int len, loff_t offset)
 {
-	DEBUGP(DCOW"cowloop - readcow called\n");
+	struct iovec	iov = { buf, len };
+
+	return cowlo_readcowv(cowdev, &iov, 1, len, offset);
+}
+
+static long int
+cowlo_readcowv(struct cowloop_device *cowdev, const struct iovec *iov,
+					int nriov, int len, loff_t offset)
+{
+	long int	rv;
+
+	DEBUGP(DCOW"cowloop - readcowv called\n");
+
+	/*
+	** the slot map of a dense cowfile might be modified meanwhile,
+	** but slots are not freed before a flush of the slot map
+	*/
+	if (cowdev->cowhead->flags & COWDENSE) {
+		down_read(&cowdev->cowsem);
+		rv = cowlo_slotio(cowdev, iov, nriov, len, offset, READ);
+		up_read(&cowdev->cowsem);
+
+		return rv;
+	}
 
 	offset += cowdev->cowhead->doffset;
 
-	return cowlo_readcowraw(cowdev, buf, len, offset);
+	rv = cowlo_readcowrawv(cowdev, iov, nriov, len, offset);
+
+	cowlo_dropcache(cowdev, cowdev->cowfp, len, offset, 0);
+
+	return rv;
+}
+
+/*
+** without double caching, the pages of a backing file that have been
+** used for a transfer of data blocks are dropped from its page cache
+** (the data is cached in the page cache of the cowdevice itself);
+** written pages can only be dropped once they are clean, so their
+** writeback is started right away and they are dropped when read
+** later on (or reclaimed as any clean page)
+*/
+static void
+cowlo_dropcache(struct cowloop_device *cowdev, struct file *fp,
+				int len, loff_t offset, int written)
+{
+	struct address_space	*mapping = fp->f_mapping;
+
+	if ( !(cowdev->pairflags & PAIRNOCACHE) || len <= 0)
+		return;
+
+	if (written)
+		filemap_fdatawrite_range(mapping, offset, offset + len - 1);
+
+	invalidate_mapping_pages(mapping, offset >> PAGE_CACHE_SHIFT,
+				(offset + len - 1) >> PAGE_CACHE_SHIFT);
 }
 
 /*
@@ -1481,12 +4669,21 @@ cowlo_readcow(struct cowloop_device *cowdev, void *buf, int len, loff_t offset)
 static long int
 cowlo_readcowraw(struct cowloop_device *cowdev,
 					void *buf, int len, loff_t offset)
+{
+	struct iovec	iov = { buf, len };
+
+	return cowlo_readcowrawv(cowdev, &iov, 1, len, offset);
+}
+
+static long int
+cowlo_readcowrawv(struct cowloop_device *cowdev, const struct iovec *iov,
+					int nriov, int len, loff_t offset)
 {
 	long int	rv;
 	mm_segment_t	old_fs;
 	loff_t		saveoffset = offset;
 
-	DEBUGP(DCOW"cowloop - readcowraw called\n");
+	DEBUGP(DCOW"cowloop - readcowrawv called\n");
 
 	/*
 	** be sure that cowfile is opened for read-write
@@ -1503,7 +4700,8 @@ cowlo_readcowraw(struct cowloop_device *cowdev,
 	*/
         old_fs = get_fs();
 	set_fs( get_ds() );
-	rv = cowdev->cowfp->f_op->read(cowdev->cowfp, buf, len, &offset);
+	rv = vfs_readv(cowdev->cowfp, (const struct iovec __user *)iov,
+							nriov, &offset);
         set_fs(old_fs);
 
 	if (rv < len) {
@@ -1526,13 +4724,25 @@ cowlo_readcowraw(struct cowloop_device *cowdev,
 */
 static long int
 cowlo_writecow(struct cowloop_device *cowdev, void *buf, int len, loff_t offset)
+{
+	struct iovec	iov = { buf, len };
+
+	return cowlo_writecowv(cowdev, &iov, 1, len, offset);
+}
+
+static long int
+cowlo_writecowv(struct cowloop_device *cowdev, const struct iovec *iov,
+					int nriov, int len, loff_t offset)
 {
 	long int	rv;
-	unsigned long	mapnum=0, mapbyte=0, mapbit=0, cowblock=0, partlen;
+	unsigned long	mapnum=0, mapbyte=0, mapbit=0, partlen, done;
+	unsigned long long cowblock=0, first, last, next;
+	int		incow, nrjext = 0;
+	struct cowjext	jext[COWJBATCH];
 	char		*tmpptr,  *mapptr = NULL;
 	loff_t		tmpoffset, mapoffset = 0;
 
-	DEBUGP(DCOW"cowloop - writecow called\n");
+	DEBUGP(DCOW"cowloop - writecowv called\n");
 
 	/*
 	** be sure that cowfile is opened for read-write
@@ -1546,10 +4756,19 @@ cowlo_writecow(struct cowloop_device *cowdev, void *buf, int len, loff_t offset)
 
 	/*
 	** write the entire block to the cowfile
+	** (to the slots of the blocks for a dense cowfile)
 	*/
-	tmpoffset = offset + cowdev->cowhead->doffset;
+	if (cowdev->cowhead->flags & COWDENSE) {
+		rv = cowlo_slotio(cowdev, iov, nriov, len, offset, WRITE);
+	} else {
+		tmpoffset = offset + cowdev->cowhead->doffset;
 
-	rv = cowlo_writecowraw(cowdev, buf, len, tmpoffset);
+		rv = cowlo_writecowrawv(cowdev, iov, nriov, len, tmpoffset);
+
+		if (rv > 0)
+			cowlo_dropcache(cowdev, cowdev->cowfp, len,
+							tmpoffset, 1);
+	}
 
 	/*
 	** verify if enough space available on filesystem holding
@@ -1612,97 +4831,155 @@ cowlo_writecow(struct cowloop_device *cowdev, void *buf, int len, loff_t offset)
 	/*
 	** check if block(s) is/are written to the cowfile
 	** for the first time; if so, adapt the bitmap
+	** (extents of blocks written before are skipped)
 	*/
-	for (; len > 0; len-=partlen, offset+=partlen, buf+=partlen) {
-		/*
-		** calculate partial length for this transfer
-		*/
-		partlen = MAPUNIT - (offset & MUMASK);
-		if (partlen > len)
-			partlen = len;
+	first = offset >> cowdev->mushift;
+	last  = (offset + len + cowdev->mumask) >> cowdev->mushift;
+
+	for (cowblock = first; cowblock < last; cowblock = next) {
+		next = cowlo_mapextent(cowdev, cowblock, last, &incow);
+
+		if (incow)		/* already written before */
+			continue;
 
 		/*
-		** calculate bitnr of written chunk of cowblock
+		** register the new extent to be logged in the journal
 		*/
-		cowblock = offset >> MUSHIFT;
+		if (cowdev->cowhead->flags & COWJOURNAL) {
+			jext[nrjext].first = cowblock;
+			jext[nrjext].count = next - cowblock;
 
-		mapnum   = CALCMAP (cowblock);
-		mapbyte  = CALCBYTE(cowblock);
-		mapbit   = CALCBIT (cowblock);
+			if (++nrjext == COWJBATCH) {
+				cowlo_journal(cowdev, jext, nrjext);
+				nrjext = 0;
+			}
+		}
 
-		if (*(*(cowdev->mapcache+mapnum)+mapbyte) & (1<<mapbit))
-			continue;	/* already written before */
+		for (; cowblock < next; cowblock++) {
+			int	markdirty = 0;
 
-	       	/*
-		** if the block is written for the first time,
-		** the corresponding bit should be set in the bitmap
-		*/
-		*(*(cowdev->mapcache+mapnum)+mapbyte) |= (1<<mapbit);
+			/*
+			** calculate the part of this block that
+			** has been transferred
+			*/
+			tmpoffset = (loff_t)cowblock << cowdev->mushift;
 
-		cowdev->nrcowblocks++;
+			if (tmpoffset < offset)
+				tmpoffset = offset;
 
-		DEBUGP(DCOW"cowloop - bitupdate blk=%ld map=%ld "
-		        "byte=%ld bit=%ld\n",
-			cowblock, mapnum, mapbyte, mapbit);
+			done    = tmpoffset - offset;
+			partlen = cowdev->mapunit - (tmpoffset & cowdev->mumask);
+			if (partlen > len - done)
+				partlen = len - done;
 
-		/*
-		** check if the cowhead in the cowfile is currently
-		** marked clean; if so, mark it dirty and flush it
-		*/
-		if ( !(cowdev->cowhead->flags &= COWDIRTY)) {
-			cowdev->cowhead->flags	|= COWDIRTY;
+			/*
+			** calculate bitnr of written chunk of cowblock
+			*/
+			mapnum   = CALCMAP (cowblock);
+			mapbyte  = CALCBYTE(cowblock);
+			mapbit   = CALCBIT (cowblock);
+
+		       	/*
+			** if the block is written for the first time, the
+			** corresponding bit should be set in the bitmap
+			** (other bits in the same byte might be set
+			** concurrently by another kernel-thread)
+			*/
+			spin_lock(&cowdev->maplock);
 
-			cowlo_writecowraw(cowdev, cowdev->cowhead,
-							MAPUNIT, (loff_t)0);
-		}
+			*(*(cowdev->mapcache+mapnum)+mapbyte) |= (1<<mapbit);
 
-		/*
-		** if the written datablock contained binary zeroes,
-		** the bitmap block should be marked to be flushed to disk
-		** (blocks containing all zeroes cannot be recovered by
-		** the cowrepair-program later on if cowloop is not properly
-		** removed via rmmod)
-		*/
-		if ( memcmp(buf, allzeroes, partlen) ) /* not all zeroes? */
-			continue;                      /* no flush needed */
+			set_bit(mapnum, cowdev->mapdirty);
 
-		/*
-		** calculate positions of bitmap block to be flushed
-		** - pointer of bitmap block in memory
-		** - offset  of bitmap block in cowfile
-		*/
-		tmpptr    = *(cowdev->mapcache+mapnum) + (mapbyte & (~MUMASK));
-		tmpoffset = (loff_t) MAPUNIT + mapnum * MAPCHUNKSZ + 
-		                                       (mapbyte & (~MUMASK));
+			cowdev->nrcowblocks++;
 
-		/*
-		** flush a bitmap block at the moment that all bits have
-		** been set in that block, i.e. at the moment that we 
-		** switch to another bitmap block
-		*/
-		if ( (mapoffset != 0) && (mapoffset != tmpoffset) ) {
-			if (cowlo_writecowraw(cowdev, mapptr, MAPUNIT,
+			/*
+			** check if the cowhead in the cowfile is currently
+			** marked clean; if so, mark it dirty and flush it
+			*/
+			if ( !(cowdev->cowhead->flags & COWDIRTY)) {
+				cowdev->cowhead->flags	|= COWDIRTY;
+				markdirty = 1;
+			}
+
+			spin_unlock(&cowdev->maplock);
+
+			DEBUGP(DCOW"cowloop - bitupdate blk=%llu map=%ld "
+			        "byte=%ld bit=%ld\n",
+				cowblock, mapnum, mapbyte, mapbit);
+
+			if (markdirty)
+				cowlo_writecowraw(cowdev, cowdev->cowhead,
+							COWHEADSZ, (loff_t)0);
+
+			/*
+			** with a journal every new block can be recovered,
+			** so an immediate bitmap flush is never needed
+			** (a dense cowfile has no bitmap in the cowfile)
+			*/
+			if (cowdev->cowhead->flags & (COWJOURNAL|COWDENSE))
+				continue;
+
+			/*
+			** if the written datablock contained binary
+			** zeroes, the bitmap block should be marked to be
+			** flushed to disk (blocks containing all zeroes
+			** cannot be recovered by the cowrepair-program
+			** later on if cowloop is not properly removed
+			** via rmmod)
+			*/
+			if ( !cowlo_iovzero(iov, nriov, done, partlen) )
+				continue;	/* not all zeroes: no flush */
+
+			/*
+			** calculate positions of bitmap block to be flushed
+			** - pointer of bitmap block in memory
+			** - offset  of bitmap block in cowfile
+			*/
+			tmpptr    = *(cowdev->mapcache+mapnum) +
+							(mapbyte & (~MUMASK));
+			tmpoffset = (loff_t) cowdev->mapunit +
+			            (loff_t)mapnum * MAPCHUNKSZ +
+			            (mapbyte & (~MUMASK));
+
+			/*
+			** flush a bitmap block at the moment that all bits
+			** have been set in that block, i.e. at the moment
+			** that we switch to another bitmap block
+			*/
+			if ( (mapoffset != 0) && (mapoffset != tmpoffset) ) {
+				if (cowlo_writecowraw(cowdev, mapptr, MAPUNIT,
 							mapoffset) < 0) {
-				printk(KERN_WARNING
-				       "cowloop - write-failure on bitmap - "
-				       "blk=%ld map=%ld byte=%ld bit=%ld\n",
-				  	cowblock, mapnum, mapbyte, mapbit);
+					printk(KERN_WARNING
+					       "cowloop - write-failure on "
+					       "bitmap - blk=%llu map=%ld "
+					       "byte=%ld bit=%ld\n",
+					  	cowblock, mapnum,
+						mapbyte, mapbit);
+				}
+
+				DEBUGP(DCOW"cowloop - bitmap blk written "
+						"%lld\n", mapoffset);
 			}
 
-			DEBUGP(DCOW"cowloop - bitmap blk written %lld\n",
-								mapoffset);
+			/*
+			** remember offset in cowfile and offset in
+			** memory for bitmap to be flushed; flushing will
+			** be done as soon as all updates in this bitmap
+			** block have been done
+			*/
+			mapoffset = tmpoffset;
+			mapptr    = tmpptr;
 		}
-
-		/*
-		** remember offset in cowfile and offset in memory
-		** for bitmap to be flushed; flushing will be done
-		** as soon as all updates in this bitmap block have
-		** been done
-		*/
-		mapoffset = tmpoffset;
-		mapptr    = tmpptr;
 	}
 
+	/*
+	** log the remaining new extents in the journal before the
+	** write is acknowledged
+	*/
+	if (nrjext)
+		cowlo_journal(cowdev, jext, nrjext);
+
 	/*
 	** any new block written containing binary zeroes?
 	*/ 
@@ -1710,7 +4987,7 @@ cowlo_writecow(struct cowloop_device *cowdev, void *buf, int len, loff_t offset)
 		if (cowlo_writecowraw(cowdev, mapptr, MAPUNIT, mapoffset) < 0) {
 			printk(KERN_WARNING
 			       "cowloop - write-failure on bitmap - "
-			       "blk=%ld map=%ld byte=%ld bit=%ld\n",
+			       "blk=%llu map=%ld byte=%ld bit=%ld\n",
 			       cowblock, mapnum, mapbyte, mapbit);
 		}
 
@@ -1728,12 +5005,21 @@ cowlo_writecow(struct cowloop_device *cowdev, void *buf, int len, loff_t offset)
 static long int
 cowlo_writecowraw(struct cowloop_device *cowdev,
 					void *buf, int len, loff_t offset)
+{
+	struct iovec	iov = { buf, len };
+
+	return cowlo_writecowrawv(cowdev, &iov, 1, len, offset);
+}
+
+static long int
+cowlo_writecowrawv(struct cowloop_device *cowdev, const struct iovec *iov,
+					int nriov, int len, loff_t offset)
 {
 	long int	rv;
 	mm_segment_t	old_fs;
 	loff_t		saveoffset = offset;
 
-	DEBUGP(DCOW"cowloop - writecowraw called\n");
+	DEBUGP(DCOW"cowloop - writecowrawv called\n");
 
 	/*
 	** be sure that cowfile is opened for read-write
@@ -1750,7 +5036,8 @@ cowlo_writecowraw(struct cowloop_device *cowdev,
 	*/
         old_fs = get_fs();
 	set_fs( get_ds() );
-	rv = cowdev->cowfp->f_op->write(cowdev->cowfp, buf, len, &offset);
+	rv = vfs_writev(cowdev->cowfp, (const struct iovec __user *)iov,
+							nriov, &offset);
         set_fs(old_fs);
 
 	if (rv < len) {
@@ -1763,6 +5050,97 @@ cowlo_writecowraw(struct cowloop_device *cowdev,
 	return rv;
 }
 
+/*
+** append a record with newly written extents of blocks to the journal;
+** when the journal is full, the modified bitmap chunks are flushed first
+** and the journal is restarted with a new generation
+**
+** must be called with the cowsem read-locked (no sync in progress)
+*/
+static void
+cowlo_journal(struct cowloop_device *cowdev, struct cowjext *ext, int nrext)
+{
+	struct cowjrec	*jrec = cowdev->jrec;
+	loff_t		offset;
+
+	down(&cowdev->jsem);
+
+	/*
+	** journal might have been abandoned by another kernel-thread
+	*/
+	if ( !(cowdev->cowhead->flags & COWJOURNAL) ) {
+		up(&cowdev->jsem);
+		return;
+	}
+
+	/*
+	** journal full: flush the bitmap (checkpoint) and
+	** invalidate all records written so far
+	*/
+	if (cowdev->jslot >= cowdev->jslots) {
+		if (cowlo_flushmap(cowdev) < 0)
+			goto nojournal;
+
+		/*
+		** the bitmap must be on disk before the cowhead with the
+		** new generation, which invalidates the records
+		*/
+		if (cowlo_fsync(cowdev) < 0)
+			goto nojournal;
+
+		cowdev->cowhead->jgen++;
+		cowdev->cowhead->cowused = cowdev->nrcowblocks;
+
+		if (cowlo_writecowraw(cowdev, cowdev->cowhead, COWHEADSZ,
+						(loff_t)0) < COWHEADSZ)
+			goto nojournal;
+
+		cowdev->jslot = 0;
+		cowdev->jcheckpoints++;
+	}
+
+	/*
+	** the data of the extents must be on disk before the record
+	** that marks them as being in the cowfile
+	*/
+	if (cowlo_fsync(cowdev) < 0)
+		goto nojournal;
+
+	/*
+	** build the record and write it into the next slot
+	*/
+	memset(jrec, 0, COWJRECSZ);
+
+	jrec->magic = COWJMAGIC;
+	jrec->nrext = nrext;
+	jrec->jgen  = cowdev->cowhead->jgen;
+	memcpy(jrec->ext, ext, nrext * sizeof(struct cowjext));
+
+	offset = (loff_t)cowdev->cowhead->joffset + cowdev->jslot * COWJRECSZ;
+
+	if (cowlo_writecowraw(cowdev, jrec, COWJRECSZ, offset) < COWJRECSZ)
+		goto nojournal;
+
+	cowdev->jslot++;
+	cowdev->jrecords++;
+
+	up(&cowdev->jsem);
+	return;
+
+	/*
+	** the journal can not be trusted any more: drop it, so that
+	** a dirty cowfile will be recovered by reading all data blocks
+	*/
+nojournal:
+	printk(KERN_WARNING "cowloop - write-failure on journal of %s; "
+	                    "journal abandoned\n", cowdev->cowname);
+
+	cowdev->cowhead->flags &= ~COWJOURNAL;
+	cowlo_writecowraw(cowdev, cowdev->cowhead, COWHEADSZ, (loff_t)0);
+
+	up(&cowdev->jsem);
+}
+
 
 /*
 ** readproc-function: called when the corresponding /proc-file is read
@@ -1771,39 +5149,98 @@ static int
 cowlo_readproc(char *buf, char **start, off_t pos, int cnt, int *eof, void *p)
 {
 	struct cowloop_device *cowdev = p;
+	unsigned long	      iosperreq;	/* in hundredths */
+
+	iosperreq = cowdev->nrrequests ?
+		    cowdev->nrbackios * 100 / cowdev->nrrequests : 0;
 
 	revision[sizeof revision - 3] = '\0';
 
 	return sprintf(buf,
 		"   cowloop version: %9s\n\n"
-		"      device state: %s%s%s%s\n"
+		"      device state: %s%s%s%s%s%s%s%s%s%s%s\n"
 		"   number of opens: %9d\n"
-		"     pid of thread: %9d\n\n"
+		"    worker threads: %9d\n"
+		"requests in flight: %9d\n"
+		"  handled requests: %9lu\n"
+		"  backing I/Os/req: %6lu.%02lu (max %lu)\n\n"
 		"    read-only file: %9s\n"
-		"          rdoreads: %9lu\n\n"
+		"          rdoreads: %9lu\n"
+		"  rdo reads passed: %9lu\n"
+		"    readahead hits: %9lu (%lu misses, window %d Kb)\n"
+		"    lower cowfiles: %9d (%lu reads, index %lu bytes)\n\n"
 		"copy-on-write file: %9s\n"
 		"     state cowfile: %9s\n"
 		"     bitmap-blocks: %9lu (of %d bytes)\n"
-		"  cowblocks in use: %9lu (of %d bytes)\n"
+		"     bitmap chunks: %9d (%lu read from cowfile)\n"
+		"   bitmap resident: %9lu bytes\n"
+		"      slots in use: %9lu (%lu free, %lu pending)\n"
+		" compressed writes: %9lu (%llu bytes saved)\n"
+		"        dedup hits: %9lu (%lu%% of %lu blocks, "
+		                                        "%llu bytes saved)\n"
+		"      bitmap syncs: %9lu (last %lu bytes)\n"
+		"   journal records: %9lu (%lu checkpoints)\n"
+		"  cowblocks in use: %9llu (of %lu bytes)\n"
 		"          cowreads: %9lu\n"
-		"         cowwrites: %9lu\n",
+		"         cowwrites: %9lu\n"
+		"          discards: %9lu (%llu blocks)\n"
+		"       zero writes: %9lu (%llu blocks)\n"
+		"   sparse copy-ups: %9lu\n"
+		"           flushes: %9lu (%lu commits)\n",
 			&revision[11],
 
 			cowdev->state & COWDEVOPEN   ? "devopen "   : "",
 			cowdev->state & COWRWCOWOPEN ? "cowopenrw " : "",
 			cowdev->state & COWRDCOWOPEN ? "cowopenro " : "",
 			cowdev->state & COWWATCHDOG  ? "watchdog "  : "",
+			cowdev->pairflags & PAIRAIO  ? "aio "       : "",
+			cowdev->pairflags & PAIRZERO ? "zero "      : "",
+			cowdev->pairflags & PAIRNOCACHE ? "nocache " : "",
+			cowdev->cowhead->flags & COWJOURNAL ? "journal " : "",
+			cowdev->cowhead->flags & COWDENSE ? "dense "     : "",
+			cowdev->cowhead->flags & COWCOMPRESS ? "compress " : "",
+			cowdev->cowhead->flags & COWDEDUP ? "dedup "     : "",
 
 			cowdev->opencnt,
-			cowdev->pid,
+			cowdev->nrrunning,
+			cowdev->inflight,
+			cowdev->nrrequests,
+			iosperreq / 100, iosperreq % 100,
+			cowdev->maxbackios,
 			cowdev->rdoname,
 			cowdev->rdoreads,
+			(unsigned long)atomic_read(&cowdev->rdopassed),
+			cowdev->rahits, cowdev->ramisses, readahead,
+			cowdev->nrlayers, cowdev->lowreads,
+			cowdev->layerbytes +
+			    cowdev->layerchunks * sizeof(unsigned char *),
 			cowdev->cowname,
 			cowdev->cowhead->flags & COWDIRTY ? "dirty":"clean",
 			cowdev->mapsize >> MUSHIFT, MAPUNIT,
-			cowdev->nrcowblocks, MAPUNIT,
+			cowdev->mapcount, cowdev->maploads,
+			cowdev->mapbytes +
+			    cowdev->mapcount * sizeof(char *) +
+			    BITS_TO_LONGS(cowdev->mapcount) * sizeof(long) +
+			    (cowdev->slotcache ?
+			       cowdev->mapcount * sizeof(unsigned int *) +
+			       BITS_TO_LONGS(cowdev->maxslots) * 3 *
+			                            sizeof(long) : 0),
+			cowdev->nextslot ? cowdev->nextslot - 1 -
+			                   cowdev->freeslots : 0,
+			cowdev->freeslots, cowdev->pendslots,
+			cowdev->compwrites, cowdev->compsaved,
+			cowdev->deduphits, cowdev->deduplookups ?
+			    cowdev->deduphits * 100 / cowdev->deduplookups : 0,
+			cowdev->deduplookups, cowdev->dedupsaved,
+			cowdev->nrsyncs, cowdev->syncbytes,
+			cowdev->jrecords, cowdev->jcheckpoints,
+			cowdev->nrcowblocks, cowdev->mapunit,
 			cowdev->cowreads,
-			cowdev->cowwrites);
+			cowdev->cowwrites,
+			cowdev->discards, cowdev->discardblocks,
+			cowdev->zerowrites, cowdev->zeroblocks,
+			cowdev->sparsecopies,
+			cowdev->flushes, cowdev->commits);
 }
 
 /*****************************************************************************/
@@ -1818,9 +5255,12 @@ cowlo_readproc(char *buf, char **start, off_t pos, int cnt, int *eof, void *p)
 **    < 0   - error value
 */
 static int
-cowlo_openpair(char *rdof, char *cowf, int autorecover, int minor)
+cowlo_openpair(char *rdof, char *cowf, int autorecover, int minor,
+				int pairflags, unsigned long mapunit,
+				char *lowf, unsigned long lowflen)
 {
 	long int		rv;
+	int			i;
 	struct cowloop_device	*cowdev = cowdevall[minor];
 	struct kstatfs		ks;
 
@@ -1850,6 +5290,25 @@ cowlo_openpair(char *rdof, char *cowf, int autorecover, int minor)
 	spin_lock_init     (&cowdev->rqlock);
 	init_waitqueue_head(&cowdev->waitq);
 	init_waitqueue_head(&cowdev->watchq);
+	INIT_LIST_HEAD     (&cowdev->reqlist);
+	init_rwsem         (&cowdev->cowsem);
+	spin_lock_init     (&cowdev->maplock);
+	spin_lock_init     (&cowdev->ralock);
+	spin_lock_init     (&cowdev->slotlock);
+	spin_lock_init     (&cowdev->complock);
+	INIT_LIST_HEAD     (&cowdev->rangelist);
+	spin_lock_init     (&cowdev->rangelock);
+	init_waitqueue_head(&cowdev->rangewaitq);
+	spin_lock_init     (&cowdev->aiolock);
+	init_waitqueue_head(&cowdev->aiowaitq);
+	INIT_LIST_HEAD     (&cowdev->aiolist);
+	sema_init          (&cowdev->jsem, 1);
+	sema_init          (&cowdev->mapsem, 1);
+	sema_init          (&cowdev->commitsem, 1);
+
+	cowdev->qdepth    = qdepth;
+	cowdev->pairflags = pairflags;
+	cowdev->mapunit   = mapunit;	/* only used for new cowfile */
 
 	/*
 	** open the read-only file
@@ -1862,6 +5321,19 @@ cowlo_openpair(char *rdof, char *cowf, int autorecover, int minor)
 		return rv;
 	}
 
+	/*
+	** open the lower cowfiles (if any) and merge their bitmaps
+	*/
+	if (lowflen) {
+		DEBUGP(DCOW"cowloop - call openlayers....\n");
+
+		if ( (rv = cowlo_openlayers(cowdev, lowf, lowflen)) ) {
+			cowlo_undo_openrdo(cowdev);
+			up(&cowdevlock);
+			return rv;
+		}
+	}
+
 	/*
 	** open the cowfile
 	*/
@@ -1920,7 +5392,8 @@ cowlo_openpair(char *rdof, char *cowf, int autorecover, int minor)
 	sprintf(cowdev->gd->disk_name, "%s%d", DEVICE_NAME, minor);
 
 	/* in .5 Kb units */
-	set_capacity(cowdev->gd, (cowdev->numblocks*(MAPUNIT/512)));
+	set_capacity(cowdev->gd, ((sector_t)cowdev->numblocks *
+						(cowdev->mapunit/512)));
 
 	DEBUGP(DCOW"cowloop - init request queue....\n");
 
@@ -1936,16 +5409,150 @@ cowlo_openpair(char *rdof, char *cowf, int autorecover, int minor)
 		return -EINVAL;
 	}
 
-	//blk_queue_hardsect_size(cowdev->rqueue, cowdev->blocksz);
-	blk_queue_logical_block_size (cowdev->rqueue, cowdev->blocksz);
-	cowdev->gd->queue = cowdev->rqueue;
+	//blk_queue_hardsect_size(cowdev->rqueue, cowdev->blocksz);
+	blk_queue_logical_block_size (cowdev->rqueue, cowdev->blocksz);
+
+	/*
+	** requests are handled as a whole, so limit their size
+	** and their number of segments to what a worker can describe;
+	** highmem pages are bounced to be directly addressable
+	*/
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,34))
+	blk_queue_max_hw_sectors(cowdev->rqueue, COWMAXSECT);
+	blk_queue_max_segments  (cowdev->rqueue, COWMAXSEGS);
+#else
+	blk_queue_max_sectors     (cowdev->rqueue, COWMAXSECT);
+	blk_queue_max_phys_segments(cowdev->rqueue, COWMAXSEGS);
+	blk_queue_max_hw_segments (cowdev->rqueue, COWMAXSEGS);
+#endif
+	blk_queue_bounce_limit(cowdev->rqueue, BLK_BOUNCE_HIGH);
+
+	/*
+	** reads of unmodified blocks can be passed to the block device
+	** below when that device accepts every bio built for the cowdevice
+	*/
+	if (cowdev->belowq && !cowdev->belowq->merge_bvec_fn) {
+		blk_queue_stack_limits(cowdev->rqueue, cowdev->belowq);
+
+		cowdev->mkrequest = cowdev->rqueue->make_request_fn;
+		cowdev->rqueue->make_request_fn = cowlo_make_request;
+	}
+
+	/*
+	** written data resides in the page cache of the cowfile for a
+	** while: flush requests have to commit it (with the bitmap)
+	*/
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37))
+	blk_queue_flush(cowdev->rqueue, REQ_FLUSH | REQ_FUA);
+#elif (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36))
+	blk_queue_ordered(cowdev->rqueue, QUEUE_ORDERED_DRAIN_FLUSH);
+#else
+	blk_queue_ordered(cowdev->rqueue, QUEUE_ORDERED_DRAIN_FLUSH,
+							cowlo_prepflush);
+#endif
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,38))
+	/*
+	** discards punch holes in the cowfile (when its filesystem
+	** offers fallocate; holes might still be refused later on)
+	** or free the slots of a dense cowfile
+	*/
+	if ( (cowdev->state & COWRWCOWOPEN) &&
+	     ((cowdev->cowhead->flags & COWDENSE) ||
+	      cowdev->cowfp->f_dentry->d_inode->i_op->fallocate) ) {
+		queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, cowdev->rqueue);
+		cowdev->rqueue->limits.discard_granularity = cowdev->mapunit;
+		blk_queue_max_discard_sectors(cowdev->rqueue,
+							COWMAXDISCARD >> 9);
+	}
+#endif
+
+	cowdev->rqueue->queuedata = cowdev;
+	cowdev->gd->queue = cowdev->rqueue;
+
+	/*
+	** start kernel threads to handle requests
+	*/
+	DEBUGP(DCOW"cowloop - kickoff daemons....\n");
+
+	cowdev->workers = vmalloc(nrthreads * sizeof(struct cowlo_worker));
+	if (!cowdev->workers) {
+		printk(KERN_WARNING
+		       "cowloop - cannot get space for %d threads\n", nrthreads);
+
+		blk_cleanup_queue(cowdev->rqueue);
+		put_disk(cowdev->gd);
+		cowlo_undo_openrdo(cowdev);
+		cowlo_undo_opencow(cowdev);
+		up(&cowdevlock);
+		return -ENOMEM;
+	}
+
+	memset(cowdev->workers, 0, nrthreads * sizeof(struct cowlo_worker));
+
+	for (i=0; i < nrthreads; i++) {
+		struct cowlo_worker	*worker = cowdev->workers+i;
+
+		worker->cowdev = cowdev;
+		worker->index  = i;
+
+		cowdev->nrrunning++;
+		cowdev->nrworkers++;
+
+		worker->pid = kernel_thread((int (*)(void *))cowlo_daemon,
+								worker, 0);
+		if (worker->pid < 0) {
+			printk(KERN_WARNING
+			       "cowloop - failed to start thread %d\n", i);
+			worker->pid = 0;
+			cowdev->nrrunning--;
+			cowdev->nrworkers--;
+			break;
+		}
+	}
 
 	/*
-	** start kernel thread to handle requests
+	** start I/O-threads for asynchronous I/O on the backing files;
+	** if not possible, the backing I/O is done synchronously
 	*/
-	DEBUGP(DCOW"cowloop - kickoff daemon....\n");
+	if (cowdev->pairflags & PAIRAIO) {
+		cowdev->iothreads = kmalloc(aiothreads *
+				sizeof(struct cowlo_iothread), GFP_KERNEL);
+
+		if (cowdev->iothreads) {
+			memset(cowdev->iothreads, 0,
+				aiothreads * sizeof(struct cowlo_iothread));
+		}
+
+		for (i=0; cowdev->iothreads && i < aiothreads; i++) {
+			struct cowlo_iothread	*iothread = cowdev->iothreads+i;
+
+			iothread->cowdev = cowdev;
+			iothread->index  = i;
+
+			cowdev->nriorunning++;
+			cowdev->nriothreads++;
+
+			iothread->pid = kernel_thread(
+					(int (*)(void *))cowlo_aiodaemon,
+					iothread, 0);
+			if (iothread->pid < 0) {
+				printk(KERN_WARNING
+				       "cowloop - failed to start "
+				       "I/O-thread %d\n", i);
+				iothread->pid = 0;
+				cowdev->nriorunning--;
+				cowdev->nriothreads--;
+				break;
+			}
+		}
 
-	cowdev->pid = kernel_thread((int (*)(void *))cowlo_daemon, cowdev, 0);
+		if (!cowdev->nriothreads) {
+			printk(KERN_WARNING
+			       "cowloop - no asynchronous I/O for %s\n", rdof);
+			cowdev->pairflags &= ~PAIRAIO;
+		}
+	}
 
 	/*
 	** create a file below directory /proc/cow for this new cowdevice
@@ -1961,8 +5568,9 @@ cowlo_openpair(char *rdof, char *cowf, int autorecover, int minor)
 
 	cowdev->state	|= COWDEVOPEN;
 
-	cowdev->rdoname = rdof;
-	cowdev->cowname = cowf;
+	cowdev->rdoname  = rdof;
+	cowdev->cowname  = cowf;
+	cowdev->lownames = lowf;
 
 	/*
 	** enable the new disk; this triggers the first request!
@@ -2016,16 +5624,31 @@ cowlo_closepair(struct cowloop_device *cowdev)
 	}
 
 	/*
-	** wakeup kernel-thread to be able to exit
-	** and wait until it has exited
+	** wakeup kernel-threads to be able to exit
+	** and wait until all of them have exited
 	*/
 	cowdev->closedown = 1;
-	cowdev->qfilled   = 1;
-	wake_up_interruptible(&cowdev->waitq);
+	wake_up_interruptible_all(&cowdev->waitq);
+
+       	while (cowdev->nrrunning)
+               	schedule();
+
+	vfree(cowdev->workers);
+	cowdev->workers   = NULL;
+	cowdev->nrworkers = 0;
+
+	/*
+	** I/O-threads finish all pending backing I/Os before exiting
+	*/
+	wake_up_interruptible_all(&cowdev->aiowaitq);
 
-       	while (cowdev->pid)
+       	while (cowdev->nriorunning)
                	schedule();
 
+	kfree(cowdev->iothreads);
+	cowdev->iothreads   = NULL;
+	cowdev->nriothreads = 0;
+
 	del_gendisk(cowdev->gd);  /* revert the alloc_disk() */
 	put_disk(cowdev->gd);     /* revert the add_disk()   */
 
@@ -2052,6 +5675,8 @@ cowlo_closepair(struct cowloop_device *cowdev)
 	if ( (cowdev->rdoname) && (cowdev->rdoname != rdofile))
 		kfree(cowdev->rdoname);
 
+	kfree(cowdev->lownames);
+
 	cowlo_undo_openrdo(cowdev);
 	cowlo_undo_opencow(cowdev);
 
@@ -2073,6 +5698,7 @@ cowlo_openrdo(struct cowloop_device *cowdev, char *rdof)
 	struct file	*f;
 	struct inode	*inode;
 	long int	i, nrval;
+	char		*buf;
 
 	DEBUGP(DCOW"cowloop - openrdo called\n");
 
@@ -2113,16 +5739,10 @@ cowlo_openrdo(struct cowloop_device *cowdev, char *rdof)
 		** read-only file is a regular file
 		*/
 		cowdev->blocksz   = 512;	/* other value fails */
-		cowdev->numblocks = inode->i_size >> MUSHIFT;
+		cowdev->rdosize   = inode->i_size;
 
-		if (inode->i_size & MUMASK) {
-			printk(KERN_WARNING
-			       "cowloop - rdofile %s truncated to multiple "
-			       "of %d bytes\n", rdof, MAPUNIT);
-		}
-
-		DEBUGP(DCOW"cowloop - RO=regular: numblocks=%d, blocksz=%d\n",
-			cowdev->numblocks, cowdev->blocksz);
+		DEBUGP(DCOW"cowloop - RO=regular: rdosize=%llu, blocksz=%d\n",
+			cowdev->rdosize, cowdev->blocksz);
 	} else {
 		/*
 		** read-only file is a block device
@@ -2131,20 +5751,20 @@ cowlo_openrdo(struct cowloop_device *cowdev, char *rdof)
 		cowdev->belowgd   = cowdev->belowdev->bd_disk; /* gendisk */
 
 		if (cowdev->belowdev->bd_part) {
-			cowdev->numblocks = cowdev->belowdev->bd_part->nr_sects
-								/ (MAPUNIT/512);
+			cowdev->rdosize = (unsigned long long)
+				cowdev->belowdev->bd_part->nr_sects << 9;
 		}
 
 		if (cowdev->belowgd) {
 			cowdev->belowq = cowdev->belowgd->queue;
 
-			if (cowdev->numblocks == 0) {
+			if (cowdev->rdosize == 0) {
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,27))
-				cowdev->numblocks = get_capacity(cowdev->belowgd)
-                         					/ (MAPUNIT/512);
+				cowdev->rdosize = (unsigned long long)
+					get_capacity(cowdev->belowgd) << 9;
 #else
-				cowdev->numblocks = cowdev->belowgd->capacity
-                         					/ (MAPUNIT/512);
+				cowdev->rdosize = (unsigned long long)
+					cowdev->belowgd->capacity << 9;
 #endif
 			}
 		}
@@ -2157,28 +5777,23 @@ cowlo_openrdo(struct cowloop_device *cowdev, char *rdof)
 		if (cowdev->blocksz == 0)
 			cowdev->blocksz = BLOCK_SIZE; /* default 2^10 */
 
-		DEBUGP(DCOW"cowloop - numblocks=%d, "
+		DEBUGP(DCOW"cowloop - rdosize=%llu, "
 		           "blocksz=%d, belowgd=%p, belowq=%p\n", 
-		  	cowdev->numblocks, cowdev->blocksz,
+		  	cowdev->rdosize, cowdev->blocksz,
 			cowdev->belowgd, cowdev->belowq);
 
 		DEBUGP(DCOW"cowloop - belowdev.bd_block_size=%d\n",
 		  	cowdev->belowdev->bd_block_size);
 	}
 
-	if (cowdev->numblocks == 0) {
+	if (cowdev->rdosize < COWFPUNIT) {
 		printk(KERN_ERR "cowloop - %s has no contents\n", rdof);
 		return -EINVAL;
 	}
 
-	/*
-	** reserve space in memory as generic I/O buffer
-	*/
-	cowdev->iobuf  = kmalloc(MAPUNIT, GFP_KERNEL);
-
-	if (!cowdev->iobuf) {
+	if ( (buf = kmalloc(COWFPUNIT, GFP_KERNEL)) == NULL) {
 		printk(KERN_ERR
-		       "cowloop - cannot get space for buffer %d\n", MAPUNIT);
+		       "cowloop - cannot get space for fingerprint\n");
 		return -ENOMEM;
 	}
 
@@ -2188,50 +5803,452 @@ cowlo_openrdo(struct cowloop_device *cowdev, char *rdof)
 	** determine fingerprint for read-only file
 	** 	calculate fingerprint from first four datablocks
 	**	which do not contain binary zeroes
+	**	(blocks of COWFPUNIT bytes, whatever the mapunit is)
 	*/
 	for (i=0, cowdev->fingerprint=0, nrval=0;
-			(nrval < 4)&&(i < cowdev->numblocks); i++) {
+		(nrval < 4)&&(i < cowdev->rdosize / COWFPUNIT); i++) {
 		int 		j;
 		unsigned char	cs;
 
 		/*
 		** read next block
 		*/
-		if (cowlo_readrdo(cowdev, cowdev->iobuf, MAPUNIT,
-						(loff_t)i << MUSHIFT) < 1)
+		if (cowlo_readrdo(cowdev, buf, COWFPUNIT,
+						(loff_t)i * COWFPUNIT) < 1)
 			break;
 
 		/*
 		** calculate fingerprint by adding all byte-values
 		*/
-		for (j=0, cs=0; j < MAPUNIT; j++)
-			cs += *(cowdev->iobuf+j);
+		for (j=0, cs=0; j < COWFPUNIT; j++)
+			cs += *(buf+j);
 
 		if (cs == 0)	/* block probably contained zeroes */
 			continue;
 
-		/*
-		** shift byte-value to proper place in final fingerprint
-		*/
-		cowdev->fingerprint |= cs << (nrval*8);
-		nrval++;
+		/*
+		** shift byte-value to proper place in final fingerprint
+		*/
+		cowdev->fingerprint |= cs << (nrval*8);
+		nrval++;
+	}
+
+	kfree(buf);
+
+	return 0;
+}
+
+/*
+** open the lower cowfiles (read-only) and verify that they are related
+** to the read-only file; a new cowfile gets the mapunit of these files
+**
+** returns:
+** 	0   - okay
+**    < 0   - error value
+*/
+static int
+cowlo_openlayers(struct cowloop_device *cowdev, char *lowf,
+						unsigned long lowflen)
+{
+	struct cowlo_layer	*layer;
+	struct cowhead		*head;
+	struct file		*f;
+	struct inode		*inode;
+	struct cowloop_device	*cowtmp;
+	unsigned long		mapunit = cowdev->mapunit;
+	char			*name;
+	int			minor;
+	long int		rv;
+
+	DEBUGP(DCOW"cowloop - openlayers called\n");
+
+	cowdev->layers = kmalloc(COWMAXLAYERS * sizeof(struct cowlo_layer),
+								GFP_KERNEL);
+	if (!cowdev->layers) {
+		printk(KERN_ERR
+		       "cowloop - cannot get space for lower cowfiles\n");
+		return -ENOMEM;
+	}
+
+	memset(cowdev->layers, 0, COWMAXLAYERS * sizeof(struct cowlo_layer));
+
+	if ( (head = kmalloc(COWHEADSZ, GFP_KERNEL)) == NULL) {
+		printk(KERN_ERR "cowloop - cannot get space for cowhead %d\n",
+								   COWHEADSZ);
+		return -ENOMEM;
+	}
+
+	/*
+	** pathnames are separated by null bytes, lowest layer first
+	*/
+	for (name = lowf, rv = 0; name < lowf + lowflen && !rv;
+					name += strlen(name) + 1) {
+		if (*name == '\0') {
+			printk(KERN_ERR
+			       "cowloop - specify name for lower cowfile\n");
+			rv = -EINVAL;
+			break;
+		}
+
+		if (cowdev->nrlayers == COWMAXLAYERS) {
+			printk(KERN_ERR "cowloop - more than %d lower "
+			                "cowfiles\n", COWMAXLAYERS);
+			rv = -EINVAL;
+			break;
+		}
+
+		f = filp_open(name, O_RDONLY|O_LARGEFILE, 0);
+
+		if ( (f == NULL) || IS_ERR(f) ) {
+			printk(KERN_ERR
+			       "cowloop - open of lower cowfile %s failed\n",
+				name);
+			rv = -EINVAL;
+			break;
+		}
+
+		layer       = cowdev->layers + cowdev->nrlayers++;
+		layer->fp   = f;
+		layer->name = name;
+
+		inode = f->f_dentry->d_inode;
+
+		if (!S_ISREG(inode->i_mode)) {
+			printk(KERN_ERR
+			       "cowloop - %s is not regular file\n", name);
+			rv = -EINVAL;
+			break;
+		}
+
+		/*
+		** a cowfile that might still be modified can not be used
+		*/
+		for (minor = 0; minor < maxcows; minor++) {
+			cowtmp = cowdevall[minor];
+
+			if ( (cowtmp->state & COWDEVOPEN) &&
+			     cowtmp->cowfp->f_dentry->d_inode == inode ) {
+				printk(KERN_ERR
+				       "cowloop - %s: already in use as cow\n",
+					name);
+				rv = -EBUSY;
+				break;
+			}
+		}
+
+		if (rv)
+			break;
+
+		/*
+		** verify the cowhead: only a clean cowfile with a bitmap
+		** can be a lower cowfile
+		*/
+		if (cowlo_readlayer(f, head, COWHEADSZ, (loff_t)0) < COWHEADSZ ||
+		    head->magic != COWMAGIC || COWHEAD32(head)) {
+			printk(KERN_ERR
+			       "cowloop - lower cowfile %s has incorrect "
+			       "format\n", name);
+			rv = -EINVAL;
+			break;
+		}
+
+		if (head->version > COWVERSION) {
+			printk(KERN_ERR
+			       "cowloop - cowfile %s newer than this driver\n",
+				name);
+			rv = -EINVAL;
+			break;
+		}
+
+		if (head->flags & (COWDIRTY|COWPACKED|COWDENSE)) {
+			printk(KERN_ERR
+			       "cowloop - lower cowfile %s %s\n", name,
+			       head->flags & COWDIRTY  ? "is dirty" :
+			       head->flags & COWPACKED ? "is packed" :
+			                                 "has a dense layout");
+			rv = -EINVAL;
+			break;
+		}
+
+		layer->mapunit = head->version < 2 ? MAPUNIT : head->mapunit;
+		layer->doffset = head->doffset;
+
+		if (layer->mapunit != cowdev->layers->mapunit) {
+			printk(KERN_ERR
+			       "cowloop - lower cowfile %s has mapunit %lu "
+			       "instead of %lu\n", name, layer->mapunit,
+				cowdev->layers->mapunit);
+			rv = -EINVAL;
+			break;
+		}
+
+		if (cowdev->nrlayers == 1 &&
+		    (rv = cowlo_setmapunit(cowdev, layer->mapunit)) )
+			break;
+
+		/*
+		** verify if the cowfile is really related to this rdofile
+		*/
+		if (head->rdoblocks != cowdev->numblocks ||
+		    head->rdofingerprint != cowdev->fingerprint) {
+			printk(KERN_ERR
+			       "cowloop - lower cowfile %s not related "
+			       "to rdofile\n", name);
+			rv = -EINVAL;
+			break;
+		}
+	}
+
+	kfree(head);
+
+	if (rv)
+		return rv;
+
+	/*
+	** a new cowfile gets the blocksize of the lower cowfiles
+	*/
+	if (mapunit != MAPUNIT && mapunit != cowdev->layers->mapunit) {
+		printk(KERN_NOTICE
+		       "cowloop - mapunit %lu of lower cowfiles is used\n",
+			cowdev->layers->mapunit);
+	}
+
+	return cowlo_layerindex(cowdev);
+}
+
+/*
+** build the index with the owning layer of every block from the bitmaps
+** of the lower cowfiles: a higher layer overrides the layers below
+**
+** returns:
+** 	0   - okay
+**    < 0   - error value
+*/
+static int
+cowlo_layerindex(struct cowloop_device *cowdev)
+{
+	struct cowlo_layer	*layer;
+	unsigned char		*lc;
+	unsigned long long	chunkstart;
+	unsigned long		numbits, numbytes, bitnr;
+	char			*mc;
+	int			i, m;
+
+	cowdev->layerchunks = CALCMAP(cowdev->numblocks - 1) + 1;
+
+	cowdev->layermap = kmalloc(cowdev->layerchunks *
+				sizeof(unsigned char *), GFP_KERNEL);
+
+	if (!cowdev->layermap) {
+		printk(KERN_ERR
+		       "cowloop - cannot get space for index of layers\n");
+		cowdev->layerchunks = 0;
+		return -ENOMEM;
+	}
+
+	memset(cowdev->layermap, 0, cowdev->layerchunks *
+						sizeof(unsigned char *));
+
+	if ( (mc = kmalloc(MAPCHUNKSZ, GFP_KERNEL)) == NULL) {
+		printk(KERN_ERR "cowloop - cannot get space for bitmap\n");
+		return -ENOMEM;
+	}
+
+	for (i=0; i < cowdev->nrlayers; i++) {
+		layer = cowdev->layers + i;
+
+		for (m=0; m < cowdev->layerchunks; m++) {
+			chunkstart = (unsigned long long)m << MAPCHUNKSHIFT;
+
+			if (cowdev->numblocks - chunkstart > MAPCHUNKBITS)
+				numbits = MAPCHUNKBITS;
+			else
+				numbits = cowdev->numblocks - chunkstart;
+
+			numbytes = (numbits + 7) >> 3;
+
+			if (cowlo_readlayer(layer->fp, mc, numbytes,
+					(loff_t)cowdev->mapunit +
+					(loff_t)m * MAPCHUNKSZ) < (long)numbytes) {
+				printk(KERN_ERR "cowloop - cannot read bitmap "
+				       "of lower cowfile %s\n", layer->name);
+				kfree(mc);
+				return -EIO;
+			}
+
+			/*
+			** register this layer for every block in it
+			*/
+			for (bitnr = cowlo_find_next_bit(mc, numbits, 0);
+			     bitnr < numbits;
+			     bitnr = cowlo_find_next_bit(mc, numbits, bitnr+1)) {
+				if ( (lc = *(cowdev->layermap+m)) == NULL) {
+					if ( (lc = vmalloc(numbits)) == NULL) {
+						printk(KERN_ERR "cowloop - "
+						       "cannot get space for "
+						       "index of layers\n");
+						kfree(mc);
+						return -ENOMEM;
+					}
+
+					memset(lc, 0, numbits);
+					*(cowdev->layermap+m) = lc;
+					cowdev->layerbytes += numbits;
+				}
+
+				*(lc+bitnr) = i + 1;
+			}
+		}
+	}
+
+	kfree(mc);
+	return 0;
+}
+
+/*
+** check if a file is one of the lower cowfiles of a cowdevice
+**
+** returns: 1 (lower cowfile) or 0
+*/
+static int
+cowlo_islayer(struct cowloop_device *cowdev, struct inode *inode)
+{
+	int	i;
+
+	for (i=0; i < cowdev->nrlayers; i++) {
+		if (cowdev->layers[i].fp->f_dentry->d_inode == inode)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+** undo memory allocs and file opens issued so far
+** related to the read-only file (and the lower cowfiles)
+*/
+static void
+cowlo_undo_openrdo(struct cowloop_device *cowdev)
+{
+	int	i;
+
+	if (cowdev->rdofp)
+  		filp_close(cowdev->rdofp, 0);
+
+	for (i=0; i < cowdev->nrlayers; i++)
+		filp_close(cowdev->layers[i].fp, 0);
+
+	if (cowdev->layermap) {
+		for (i=0; i < cowdev->layerchunks; i++)
+			vfree(*(cowdev->layermap+i));
+
+		kfree(cowdev->layermap);
+	}
+
+	kfree(cowdev->layers);
+}
+
+/*
+** convert the cowhead of a cowfile written by a 32-bit system to the
+** fixed-width cowhead
+** the journal records of such cowfile have another layout as well;
+** they are invalidated by a new generation, so a dirty cowfile must
+** be recovered from its data blocks instead
+**
+** returns:
+** 	0   - okay
+**    < 0   - error value
+*/
+static int
+cowlo_convhead(struct cowloop_device *cowdev, int autorecover)
+{
+	struct cowhead32	h32;
+
+	memcpy(&h32, cowdev->cowhead, sizeof h32);
+
+	if (h32.mapunit < MINMAPUNIT || h32.mapunit > MAXMAPUNIT) {
+		printk(KERN_ERR "cowloop - cowhead has incorrect format\n");
+		return -EINVAL;
+	}
+
+	if ( (h32.flags & COWJOURNAL) && (h32.flags & COWDIRTY) &&
+	     !autorecover ) {
+		printk(KERN_ERR
+		       "cowloop - dirty cowfile with 32-bit journal; "
+		       "run cowrepair or specify 'option=r' to recover\n");
+		return -EINVAL;
+	}
+
+	cowconvhead(cowdev->cowhead);
+
+	if (cowdev->cowhead->version >= 2)
+		cowdev->cowhead->jgen++;	/* invalidate 32-bit records */
+
+	cowdev->convhead = 1;
+	return 0;
+}
+
+/*
+** set the blocksize per bit in the bitmap of a cowdevice and derive
+** the number of blocks of the read-only file and the bitmap size
+**
+** returns:
+** 	0   - okay
+**    < 0   - error value
+*/
+static int
+cowlo_setmapunit(struct cowloop_device *cowdev, unsigned long mapunit)
+{
+	unsigned long	nb;
+
+	if (mapunit < MINMAPUNIT || mapunit > MAXMAPUNIT ||
+	    (mapunit & (mapunit-1)) ) {
+		printk(KERN_ERR "cowloop - mapunit %lu not supported "
+		                "(power of 2 from %d upto %d)\n",
+				mapunit, MINMAPUNIT, MAXMAPUNIT);
+		return -EINVAL;
+	}
+
+	cowdev->mapunit   = mapunit;
+	cowdev->mushift   = ffs((int)mapunit) - 1;
+	cowdev->mumask    = mapunit - 1;
+	cowdev->numblocks = cowdev->rdosize >> cowdev->mushift;
+
+	if (cowdev->rdosize & cowdev->mumask) {
+		printk(KERN_WARNING
+		       "cowloop - rdofile truncated to multiple "
+		       "of %lu bytes\n", mapunit);
+	}
+
+	if (cowdev->numblocks == 0) {
+		printk(KERN_ERR
+		       "cowloop - rdofile smaller than mapunit %lu\n", mapunit);
+		return -EINVAL;
+	}
+
+	/*
+	** the bitmap must fit in memory (mapsize is a long)
+	*/
+	if ( (cowdev->numblocks >> 3) > (LONG_MAX >> 1) ) {
+		printk(KERN_ERR
+		       "cowloop - rdofile too large for mapunit %lu\n",
+		       mapunit);
+		return -EFBIG;
 	}
 
-	return 0;
-}
+	/*
+	** calculate size (in bytes) for total bitmap in cowfile;
+	** when the size of the cowhead block is added, the start-offset
+	** for the modified data blocks can be found
+	*/
+	nb = (cowdev->numblocks + 7) >> 3;  /* transform #bits to #bytes */
 
-/*
-** undo memory allocs and file opens issued so far
-** related to the read-only file
-*/
-static void
-cowlo_undo_openrdo(struct cowloop_device *cowdev)
-{
-	if(cowdev->iobuf);
-		kfree(cowdev->iobuf);
+	if (nb & MUMASK)	/* round up #bytes to MAPUNIT chunks */
+		cowdev->mapsize = ( (nb>>MUSHIFT) +1) << MUSHIFT;
+	else
+		cowdev->mapsize = nb;
 
-	if (cowdev->rdofp)
-  		filp_close(cowdev->rdofp, 0);
+	return 0;
 }
 
 /*
@@ -2245,8 +6262,7 @@ static int
 cowlo_opencow(struct cowloop_device *cowdev, char *cowf, int autorecover)
 {
 	long int		i, rv;
-	int			minor;
-	unsigned long		nb;
+	int			minor, wasdirty;
 	struct file		*f;
 	struct inode		*inode;
 	loff_t			offset;
@@ -2309,38 +6325,36 @@ cowlo_opencow(struct cowloop_device *cowdev, char *cowf, int autorecover)
 	}
 
 	/*
-	** mark cowfile open for read-write
+	** a lower cowfile (of any cowdevice) can not be modified
 	*/
-	cowdev->state |= COWRWCOWOPEN;
+	for (minor = 0; minor < maxcows; minor++) {
+		cowtmp = cowdevall[minor];
+
+		if ( (cowtmp == cowdev || (cowtmp->state & COWDEVOPEN)) &&
+		     cowlo_islayer(cowtmp, inode) ) {
+			printk(KERN_ERR
+			       "cowloop - %s: in use as lower cowfile\n", cowf);
+			return -EBUSY;
+		}
+	}
 
 	/*
-	** calculate size (in bytes) for total bitmap in cowfile;
-	** when the size of the cowhead block is added, the start-offset
-	** for the modified data blocks can be found
+	** mark cowfile open for read-write
 	*/
-	nb = cowdev->numblocks;
-
-	if (nb%8)		/* transform #bits to #bytes */
-		nb+=8;  	/* rounded if necessary      */
-	nb /= 8;
-
-	if (nb & MUMASK)	/* round up #bytes to MAPUNIT chunks */
-		cowdev->mapsize = ( (nb>>MUSHIFT) +1) << MUSHIFT;
-	else
-		cowdev->mapsize = nb;
+	cowdev->state |= COWRWCOWOPEN;
 
 	/*
 	** reserve space in memory for the cowhead
 	*/
-	cowdev->cowhead = kmalloc(MAPUNIT, GFP_KERNEL);
+	cowdev->cowhead = kmalloc(COWHEADSZ, GFP_KERNEL);
 
 	if (!cowdev->cowhead) {
 		printk(KERN_ERR "cowloop - cannot get space for cowhead %d\n",
-								     MAPUNIT);
+								   COWHEADSZ);
 		return -ENOMEM;
 	}
 
-	memset(cowdev->cowhead, 0, MAPUNIT);
+	memset(cowdev->cowhead, 0, COWHEADSZ);
 
 	DEBUGP(DCOW"cowloop - prepare cowhead....\n");
 
@@ -2351,14 +6365,14 @@ cowlo_opencow(struct cowloop_device *cowdev, char *cowf, int autorecover)
 		/*
 		** existing cowfile: read the cow head
 		*/
-		if (inode->i_size < MAPUNIT) {
+		if (inode->i_size < COWHEADSZ) {
 			printk(KERN_ERR
 			       "cowloop - existing cowfile %s too small\n",
 				cowf);
 			return -EINVAL;
 		}
 
-		cowlo_readcowraw(cowdev, cowdev->cowhead, MAPUNIT, (loff_t) 0);
+		cowlo_readcowraw(cowdev, cowdev->cowhead, COWHEADSZ, (loff_t) 0);
 
 		/*
 		** verify if the existing file is really a cowfile
@@ -2370,6 +6384,19 @@ cowlo_opencow(struct cowloop_device *cowdev, char *cowf, int autorecover)
 			return -EINVAL;
 		}
 
+		/*
+		** a cowhead written by a 32-bit system is converted to
+		** the fixed-width cowhead (written back later on)
+		*/
+		if ( COWHEAD32(cowdev->cowhead) ) {
+			printk(KERN_NOTICE
+			       "cowloop - convert 32-bit cowhead of %s\n",
+				cowf);
+
+			if ( (rv = cowlo_convhead(cowdev, autorecover)) )
+				return rv;
+		}
+
 		/*
 		** verify the cowhead version of the cowfile
 		*/
@@ -2380,6 +6407,27 @@ cowlo_opencow(struct cowloop_device *cowdev, char *cowf, int autorecover)
 			return -EINVAL;
 		}
 
+		/*
+		** the blocksize of a version 1 cowfile is always MAPUNIT
+		*/
+		if ( (rv = cowlo_setmapunit(cowdev,
+				cowdev->cowhead->version < 2 ?
+				MAPUNIT : cowdev->cowhead->mapunit)) )
+			return rv;
+
+		/*
+		** the index of the lower cowfiles (if any) is based on
+		** their blocksize
+		*/
+		if (cowdev->nrlayers &&
+		    cowdev->mapunit != cowdev->layers->mapunit) {
+			printk(KERN_ERR
+			       "cowloop - cowfile %s has mapunit %lu instead "
+			       "of %lu (lower cowfiles)\n", cowf,
+				cowdev->mapunit, cowdev->layers->mapunit);
+			return -EINVAL;
+		}
+
 		/*
 		** make sure that this is not a packed cowfile
 		*/
@@ -2396,9 +6444,11 @@ cowlo_opencow(struct cowloop_device *cowdev, char *cowf, int autorecover)
 			/*
 			** cowfile was not properly closed;
 			** check if automatic recovery is required
-			** (actual recovery will be done later on)
+			** (actual recovery will be done later on;
+			** a journal can always be replayed safely)
 			*/
-			if (!autorecover) {
+			if (!autorecover && !(cowdev->cowhead->flags &
+			                        (COWJOURNAL|COWDENSE))) {
 				printk(KERN_ERR
 				       "cowloop - cowfile %s is dirty "
 				       "(not properly closed by rmmod?)\n",
@@ -2415,11 +6465,11 @@ cowlo_opencow(struct cowloop_device *cowdev, char *cowf, int autorecover)
 		*/
 		if (cowdev->cowhead->rdoblocks != cowdev->numblocks) {
 			printk(KERN_ERR
-		       	       "cowloop - cowfile %s (size %lld) not related "
-		       	       "to rdofile (size %lld)\n",
+		       	       "cowloop - cowfile %s (size %llu) not related "
+		       	       "to rdofile (size %llu)\n",
 				cowf,
-				(long long)cowdev->cowhead->rdoblocks <<MUSHIFT,
-				(long long)cowdev->numblocks <<MUSHIFT);
+				cowdev->cowhead->rdoblocks << cowdev->mushift,
+				cowdev->numblocks << cowdev->mushift);
 			return -EINVAL;
 		}
 
@@ -2429,11 +6479,80 @@ cowlo_opencow(struct cowloop_device *cowdev, char *cowf, int autorecover)
 			     " (fingerprint err - rdofile modified?)\n", cowf);
 			return -EINVAL;
 		}
+
+		/*
+		** verify if the journal (if any) lies between the
+		** bitmap and the data blocks
+		*/
+		if ( (cowdev->cowhead->flags & COWJOURNAL) &&
+		     ( cowdev->cowhead->jsize < COWJRECSZ                 ||
+		       cowdev->cowhead->joffset <
+		                       cowdev->mapunit + cowdev->mapsize  ||
+		       cowdev->cowhead->joffset + cowdev->cowhead->jsize >
+		                                 cowdev->cowhead->doffset   ) ) {
+			printk(KERN_ERR
+			       "cowloop - cowfile %s has incorrect journal\n",
+				cowf);
+			return -EINVAL;
+		}
+
+		/*
+		** verify if the slot map (if any) lies between the
+		** cowhead and the data blocks
+		*/
+		if ( (cowdev->cowhead->flags & COWBLOCKIO) &&
+		    !(cowdev->cowhead->flags & COWDENSE) ) {
+			printk(KERN_ERR
+			       "cowloop - cowfile %s has incorrect slot map\n",
+				cowf);
+			return -EINVAL;
+		}
+
+		if ( (cowdev->cowhead->flags & COWDENSE) &&
+		     ( (cowdev->cowhead->flags & COWJOURNAL)              ||
+		       cowdev->cowhead->ssize < cowdev->numblocks *
+		          sizeof(unsigned int) <<
+		          (cowdev->cowhead->flags & COWCOMPRESS ? 1 : 0)  ||
+		       cowdev->cowhead->soffset < cowdev->mapunit         ||
+		       cowdev->cowhead->soffset + cowdev->cowhead->ssize >
+		                                 cowdev->cowhead->doffset ||
+		       cowdev->cowhead->nextslot < 1                        ) ) {
+			printk(KERN_ERR
+			       "cowloop - cowfile %s has incorrect slot map\n",
+				cowf);
+			return -EINVAL;
+		}
+
+		/*
+		** a journal can only be added to a new cowfile
+		*/
+		if ( (cowdev->pairflags & PAIRJOURNAL) &&
+		    !(cowdev->cowhead->flags & COWJOURNAL)  ) {
+			printk(KERN_NOTICE
+			       "cowloop - existing cowfile %s has no journal\n",
+				cowf);
+		}
+
+		/*
+		** the same applies to the dense layout
+		*/
+		if ( (cowdev->pairflags & (PAIRDENSE|PAIRCOMPRESS|PAIRDEDUP)) &&
+		    !(cowdev->cowhead->flags & COWDENSE)  ) {
+			printk(KERN_NOTICE
+			       "cowloop - existing cowfile %s has no dense "
+			       "layout\n", cowf);
+		}
 	} else {
+		/*
+		** new cowfile with the requested blocksize
+		*/
+		if ( (rv = cowlo_setmapunit(cowdev, cowdev->mapunit)) )
+			return rv;
+
 		/*
 		** new cowfile: determine the minimal size (cowhead+bitmap)
 		*/
-		offset = (loff_t) MAPUNIT + cowdev->mapsize - 1;
+		offset = (loff_t) cowdev->mapunit + cowdev->mapsize - 1;
 
 		if ( cowlo_writecowraw(cowdev, "", 1, offset) < 1) {
 			printk(KERN_ERR
@@ -2447,7 +6566,7 @@ cowlo_opencow(struct cowloop_device *cowdev, char *cowf, int autorecover)
 		*/
 		cowdev->cowhead->magic		= COWMAGIC;
 		cowdev->cowhead->version	= COWVERSION;
-		cowdev->cowhead->mapunit	= MAPUNIT;
+		cowdev->cowhead->mapunit	= cowdev->mapunit;
 		cowdev->cowhead->mapsize	= cowdev->mapsize;
 		cowdev->cowhead->rdoblocks	= cowdev->numblocks;
 		cowdev->cowhead->rdofingerprint	= cowdev->fingerprint;
@@ -2460,17 +6579,143 @@ cowlo_opencow(struct cowloop_device *cowdev, char *cowf, int autorecover)
 		** the sparsed cowfile on e.g. 4K filesystems
 		*/	
 		cowdev->cowhead->doffset =
-			((MAPUNIT+cowdev->mapsize+4095)>>12)<<12;
+			((cowdev->mapunit+cowdev->mapsize+4095)>>12)<<12;
+
+		/*
+		** a dense cowfile has a slot map instead of the bitmap;
+		** the slot map is always consistent on disk, so a journal
+		** is never needed
+		*/
+		if (cowdev->pairflags & (PAIRDENSE|PAIRCOMPRESS|PAIRDEDUP)) {
+			if (cowdev->numblocks > COWMAXDENSE) {
+				printk(KERN_ERR "cowloop - rdofile too large "
+				                "for dense cowfile\n");
+				return -EFBIG;
+			}
+
+			if (cowdev->pairflags & PAIRJOURNAL)
+				printk(KERN_NOTICE "cowloop - no journal "
+				       "for dense cowfile %s\n", cowf);
+
+			if ( (cowdev->pairflags & PAIRCOMPRESS) &&
+			     cowdev->mapunit < COWCOMPUNIT ) {
+				printk(KERN_ERR "cowloop - mapunit of "
+				       "compressed cowfile must be at least "
+				       "%d\n", COWCOMPUNIT);
+				return -EINVAL;
+			}
+
+			cowdev->cowhead->flags	  = COWDENSE;
+
+			if (cowdev->pairflags & PAIRCOMPRESS)
+				cowdev->cowhead->flags |= COWCOMPRESS;
+
+			if (cowdev->pairflags & PAIRDEDUP)
+				cowdev->cowhead->flags |= COWDEDUP;
+
+			cowdev->cowhead->soffset  = cowdev->mapunit;
+			cowdev->cowhead->ssize	  = ((cowdev->numblocks *
+				sizeof(unsigned int) <<
+				(cowdev->pairflags & PAIRCOMPRESS ? 1 : 0)) +
+						MUMASK) >> MUSHIFT << MUSHIFT;
+			cowdev->cowhead->nextslot = 1;
+			cowdev->cowhead->doffset  = ((cowdev->cowhead->soffset +
+				     cowdev->cowhead->ssize + 4095) >> 12) << 12;
+
+			offset = (loff_t) cowdev->cowhead->soffset +
+					  cowdev->cowhead->ssize - 1;
+
+			if ( cowlo_writecowraw(cowdev, "", 1, offset) < 1) {
+				printk(KERN_ERR
+				       "cowloop - cannot set cowfile to "
+				       "size %lld\n", offset+1);
+				return -EINVAL;
+			}
+		}
+
+		/*
+		** reserve a journal in front of the data (if wanted)
+		*/
+		else if (cowdev->pairflags & PAIRJOURNAL) {
+			cowdev->cowhead->flags	 = COWJOURNAL;
+			cowdev->cowhead->joffset = cowdev->cowhead->doffset;
+			cowdev->cowhead->jsize	 = COWJOURNALSZ;
+			cowdev->cowhead->jgen	 = 1;
+			cowdev->cowhead->doffset+= COWJOURNALSZ;
+		}
+
+		/*
+		** older drivers and utilities do not know the journal
+		** nor another blocksize nor the dense layout nor the
+		** compression nor shared slots, so only such cowfiles
+		** get a newer cowhead version
+		*/
+		if ( !(cowdev->cowhead->flags & COWDEDUP) )
+			cowdev->cowhead->version = 4;
+
+		if ( !(cowdev->cowhead->flags & (COWCOMPRESS|COWDEDUP)) )
+			cowdev->cowhead->version = 3;
+
+		if ( !(cowdev->cowhead->flags & COWDENSE) )
+			cowdev->cowhead->version = 2;
+
+		if ( !(cowdev->cowhead->flags & (COWJOURNAL|COWDENSE)) &&
+		     cowdev->mapunit == MAPUNIT)
+			cowdev->cowhead->version = 1;
+	}
+
+	/*
+	** create a pool of copy-up buffers; every kernel-thread uses
+	** at most one buffer at a time, so with one reserved buffer per
+	** kernel-thread copy-ups never wait for memory to be freed
+	*/
+	cowdev->bufpool = mempool_create_kmalloc_pool(nrthreads,
+							COWBUFSZ(cowdev));
+	if (!cowdev->bufpool) {
+		printk(KERN_ERR "cowloop - cannot get space for buffers %lu\n",
+							COWBUFSZ(cowdev));
+		return -ENOMEM;
+	}
+
+	/*
+	** the cowhead in memory is clean until the first modification
+	** (remember the state on disk to decide about recovery)
+	*/
+	wasdirty = cowdev->cowhead->flags & COWDIRTY;
+
+	cowdev->cowhead->flags	&= (COWJOURNAL|COWDENSE|COWCOMPRESS|COWDEDUP);
+
+	/*
+	** a dense cowfile is never recovered: its slot map is
+	** consistent as flushed last
+	*/
+	if (wasdirty && (cowdev->cowhead->flags & COWDENSE)) {
+		printk(KERN_NOTICE
+		       "cowloop - cowfile %s not properly closed; blocks "
+		       "written after the last flush are lost\n", cowf);
+		wasdirty = 0;
 	}
 
-	cowdev->cowhead->flags	= 0;
+	/*
+	** prepare the buffer for journal records
+	*/
+	if (cowdev->cowhead->flags & COWJOURNAL) {
+		cowdev->jrec = kmalloc(COWJRECSZ, GFP_KERNEL);
+
+		if (!cowdev->jrec) {
+			printk(KERN_ERR
+			       "cowloop - cannot get space for journal\n");
+			return -ENOMEM;
+		}
+
+		cowdev->jslots = cowdev->cowhead->jsize / COWJRECSZ;
+		cowdev->jslot  = 0;
+	}
 
 	DEBUGP(DCOW"cowloop - reserve space bitmap....\n");
 
 	/*
-	** reserve space in memory for the entire bitmap and
-	** fill it with the bitmap-data from disk; the entire
-	** bitmap is allocated in several chunks because kmalloc
+	** the bitmap is kept in memory in several chunks because kmalloc
 	** has restrictions regarding the allowed size per kmalloc
 	*/
 	cowdev->mapcount = (cowdev->mapsize+MAPCHUNKSZ-1)/MAPCHUNKSZ;
@@ -2496,129 +6741,316 @@ cowlo_opencow(struct cowloop_device *cowdev, char *cowf, int autorecover)
 		return -ENOMEM;
 	}
 
-	memset(cowdev->mapcache, 0, cowdev->mapcount * sizeof(char *)); 
+	memset(cowdev->mapcache, 0, cowdev->mapcount * sizeof(char *)); 
+
+	/*
+	** allocate space to register which bitmap-chunks are modified
+	*/
+	cowdev->mapdirty = kmalloc(BITS_TO_LONGS(cowdev->mapcount) *
+					sizeof(unsigned long), GFP_KERNEL);
+	if (!cowdev->mapdirty) {
+		printk(KERN_ERR
+		       "cowloop - can not allocate space for bitmap admin\n");
+		return -ENOMEM;
+	}
+
+	memset(cowdev->mapdirty, 0, BITS_TO_LONGS(cowdev->mapcount) *
+						sizeof(unsigned long));
+
+	/*
+	** find out which slots of a dense cowfile are free
+	*/
+	if ( (cowdev->cowhead->flags & COWDENSE) &&
+	     (rv = cowlo_slotinit(cowdev)) )
+		return rv;
+
+	if ( (cowdev->cowhead->flags & COWBLOCKIO) &&
+	     (rv = cowlo_compinit(cowdev)) )
+		return rv;
+
+	if ( (cowdev->cowhead->flags & COWDEDUP) &&
+	     (rv = cowlo_dedupinit(cowdev)) )
+		return rv;
+
+	/*
+	** the bitmap-chunks themselves are read from the cowfile on first
+	** access by the I/O-path; only a dirty cowfile needs its entire
+	** bitmap in memory now to be recovered
+	*/
+	if (wasdirty) {
+		DEBUGP(DCOW"cowloop - read bitmap from cow....\n");
+
+		for (i=0; i < cowdev->mapcount; i++) {
+			if (cowlo_mapchunk(cowdev, i, 1) == NULL)
+				return -ENOMEM;
+		}
+	}
+
+	/*
+	** if the cowfile was dirty and has a journal, replay the
+	** journal records of the current generation on the bitmap
+	*/
+	if (wasdirty && (cowdev->cowhead->flags & COWJOURNAL) &&
+	    !cowdev->convhead) {
+		char		*jbuf;
+		struct cowjrec	*jrec;
+		unsigned long	slot, nrrec = 0;
+		unsigned long long blocknum;
+		int		e;
+
+		printk(KERN_NOTICE "cowloop - replay journal of cowfile %s\n",
+							cowf);
+
+		if ( (jbuf = vmalloc(cowdev->cowhead->jsize)) == NULL) {
+			printk(KERN_ERR
+			       "cowloop - cannot get space for journal\n");
+			return -ENOMEM;
+		}
+
+		if (cowlo_readcowraw(cowdev, jbuf, cowdev->cowhead->jsize,
+			(loff_t)cowdev->cowhead->joffset) < 0)
+			memset(jbuf, 0, cowdev->cowhead->jsize);
+
+		for (slot=0; slot < cowdev->jslots; slot++) {
+			jrec = (struct cowjrec *)(jbuf + slot * COWJRECSZ);
+
+			if (jrec->magic != COWJMAGIC		     ||
+			    jrec->jgen  != cowdev->cowhead->jgen     ||
+			    jrec->nrext <  0 || jrec->nrext > COWJEXTS)
+				continue;	/* stale or unused slot */
+
+			for (e=0; e < jrec->nrext; e++) {
+				struct cowjext *ext = &jrec->ext[e];
+
+				for (blocknum = ext->first;
+				     blocknum < ext->first + ext->count &&
+				     blocknum < cowdev->numblocks; blocknum++) {
+					*(*(cowdev->mapcache+CALCMAP(blocknum))+
+					  CALCBYTE(blocknum)) |=
+						(1<<CALCBIT(blocknum));
+				}
+			}
+
+			nrrec++;
+		}
+
+		vfree(jbuf);
+
+		/*
+		** the entire bitmap has to be flushed
+		*/
+		for (i=0; i < cowdev->mapcount; i++)
+			set_bit(i, cowdev->mapdirty);
+
+		printk(KERN_NOTICE "cowloop - %lu journal records replayed\n",
+							nrrec);
+	}
+
+	/*
+	** if the cowfile was dirty and automatic recovery is required,
+	** reconstruct a proper bitmap in memory now
+	*/
+	else if (wasdirty) {
+		printk(KERN_NOTICE "cowloop - recover dirty cowfile %s....\n",
+							cowf);
+
+		if ( (rv = cowlo_recover(cowdev)) )
+			return rv;
+
+		printk(KERN_NOTICE "cowloop - cowfile recovery completed\n");
+	}
+
+	/*
+	** number of blocks in use (statistical purposes): a clean cowhead
+	** is up-to-date, otherwise count all bits in the recovered bitmap
+	*/
+	if (wasdirty) {
+		for (i=0, cowdev->nrcowblocks = 0; i < cowdev->mapcount; i++) {
+			cowdev->nrcowblocks += bitmap_weight(
+				(unsigned long *)*(cowdev->mapcache+i),
+				(i < cowdev->mapcount-1 ? MAPCHUNKSZ :
+				                          cowdev->mapremain) * 8);
+		}
+	} else if ( !(cowdev->cowhead->flags & COWDENSE) ) {
+		cowdev->nrcowblocks = cowdev->cowhead->cowused;
+	}
+
+	/*
+	** a converted cowhead is written back at once (after the
+	** recovered bitmap), so the cowfile is never interpreted
+	** with the 32-bit layout again
+	*/
+	if (cowdev->convhead) {
+		cowdev->cowhead->cowused = cowdev->nrcowblocks;
+
+		if (cowlo_flushmap(cowdev) < 0 ||
+		    cowlo_writecowraw(cowdev, cowdev->cowhead, COWHEADSZ,
+						(loff_t)0) < COWHEADSZ) {
+			printk(KERN_ERR
+			       "cowloop - cannot write converted cowhead\n");
+			return -EIO;
+		}
+	}
+
+	return 0;
+}
+
+/*
+** reconstruct the bitmap of a dirty cowfile from its data blocks;
+** only the ranges of the cowfile that have been allocated by the
+** filesystem are read, because holes contain binary zeroes anyhow
+**
+** returns:
+** 	0   - okay
+**    < 0   - error value
+*/
+static int
+cowlo_recover(struct cowloop_device *cowdev)
+{
+	struct inode		*inode = cowdev->cowfp->f_dentry->d_inode;
+	loff_t			pos, end;
+	char			*databuf;
+	int			i;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,28))
+	struct fiemap_extent	*fext;
+	struct fiemap_extent_info fieinfo;
+	mm_segment_t		old_fs;
+	loff_t			prev, start, stop;
+	int			e, rv;
+#endif
+
+	if ( (databuf = vmalloc(COWRECOVSZ)) == NULL) {
+		printk(KERN_ERR "cowloop - cannot get space for recovery\n");
+		return -ENOMEM;
+	}
+
+	pos = cowdev->cowhead->doffset;
+	end = inode->i_size;
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,28))
+	/*
+	** ask the filesystem for the data extents of the cowfile
+	** (dirty pages are written first to get them allocated);
+	** without extent info the remainder is read entirely
+	*/
+	fext = kmalloc(COWFIEXTS * sizeof(struct fiemap_extent), GFP_KERNEL);
+
+	if (fext && inode->i_op && inode->i_op->fiemap &&
+	    filemap_write_and_wait(inode->i_mapping) == 0) {
+		while (pos < end) {
+			memset(&fieinfo, 0, sizeof fieinfo);
+
+			fieinfo.fi_extents_max   = COWFIEXTS;
+			fieinfo.fi_extents_start =
+					(struct fiemap_extent __user *)fext;
+
+			old_fs = get_fs();
+			set_fs( get_ds() );
+			rv = inode->i_op->fiemap(inode, &fieinfo, pos, end-pos);
+			set_fs(old_fs);
+
+			if (rv)
+				break;
+
+			if (fieinfo.fi_extents_mapped == 0) {
+				pos = end;	/* only holes remaining */
+				break;
+			}
+
+			for (e=0, prev=pos; e < fieinfo.fi_extents_mapped; e++) {
+				start = fext[e].fe_logical;
+				stop  = fext[e].fe_logical + fext[e].fe_length;
+
+				if (start < pos)
+					start = pos;
+				if (stop > end)
+					stop = end;
+
+				/*
+				** preallocated extents read as zeroes
+				*/
+				if (start < stop &&
+				  !(fext[e].fe_flags & FIEMAP_EXTENT_UNWRITTEN))
+					cowlo_recoverrange(cowdev, databuf,
+								start, stop);
+				if (stop > pos)
+					pos = stop;
+
+				if (fext[e].fe_flags & FIEMAP_EXTENT_LAST)
+					pos = end;
+			}
+
+			if (pos == prev)	/* no progress: read remainder */
+				break;
+		}
+	}
+
+	if (fext)
+		kfree(fext);
+#endif
 
 	/*
-	** allocate space to store the bitmap-chunks themselves
+	** read the remaining part of the cowfile (if any)
 	*/
-	for (i=0; i < cowdev->mapcount; i++) {
-		if (i < (cowdev->mapcount-1))
-			*(cowdev->mapcache+i) = kmalloc(MAPCHUNKSZ, GFP_KERNEL);
-		else
-			*(cowdev->mapcache+i) = kmalloc(cowdev->mapremain,
-						                  GFP_KERNEL);
-
-		if (*(cowdev->mapcache+i) == NULL) {
-			printk(KERN_ERR "cowloop - no space for bitmapchunk %ld"
-					" totmapsz=%ld, mapcnt=%d mapunit=%d\n",
-					i, cowdev->mapsize, cowdev->mapcount,
-					MAPUNIT);
-			return -ENOMEM;
-		}
-	}
+	if (pos < end)
+		cowlo_recoverrange(cowdev, databuf, pos, end);
 
-	DEBUGP(DCOW"cowloop - read bitmap from cow....\n");
+	vfree(databuf);
 
 	/*
-	** read the entire bitmap from the cowfile into the in-memory cache;
-	** count the number of blocks that are in use already
-	** (statistical purposes)
+	** the entire reconstructed bitmap has to be flushed
 	*/
-	for (i=0, offset=MAPUNIT; i < cowdev->mapcount;
-					i++, offset+=MAPCHUNKSZ) {
-		unsigned long	numbytes;
+	for (i=0; i < cowdev->mapcount; i++)
+		set_bit(i, cowdev->mapdirty);
 
-		if (i < (cowdev->mapcount-1))
-			/*
-			** full bitmap chunk
-			*/
-			numbytes = MAPCHUNKSZ;
-		else
-			/*
-			** last bitmap chunk: might be partly filled
-			*/
-			numbytes = cowdev->mapremain;
+	return 0;
+}
 
-		cowlo_readcowraw(cowdev, *(cowdev->mapcache+i),
-							numbytes, offset);
-	}
+/*
+** read a range of the cowfile (absolute offsets) with large reads and
+** set the bit in the bitmap for every data block that does not only
+** contain binary zeroes
+*/
+static void
+cowlo_recoverrange(struct cowloop_device *cowdev, char *databuf,
+					loff_t start, loff_t stop)
+{
+	unsigned long long blocknum;
+	unsigned long	done;
+	long int	rv, cnt;
+	loff_t		doffset = cowdev->cowhead->doffset;
 
 	/*
-	** if the cowfile was dirty and automatic recovery is required,
-	** reconstruct a proper bitmap in memory now
+	** extend the range to entire data blocks
 	*/
-	if (cowdev->cowhead->flags & COWDIRTY) {
-		unsigned long long	blocknum;
-		char			databuf[MAPUNIT];
-		unsigned long		mapnum, mapbyte, mapbit;
+	start = doffset + ((start - doffset) & ~(loff_t)cowdev->mumask);
+	stop  = doffset + ((stop - doffset + cowdev->mumask) &
+						~(loff_t)cowdev->mumask);
 
-		printk(KERN_NOTICE "cowloop - recover dirty cowfile %s....\n",
-							cowf);
+	for (; start < stop; start += rv) {
+		cnt = stop - start < COWRECOVSZ ? stop - start : COWRECOVSZ;
 
-		/*
-		** read all data blocks
-		*/
-		for (blocknum=0, rv=1, offset=0;
-			cowlo_readcow(cowdev, databuf, MAPUNIT, offset) > 0;
-			blocknum++, offset += MAPUNIT) {
+		if ( (rv = cowlo_readcowraw(cowdev, databuf, cnt, start)) <= 0)
+			break;
+
+		blocknum = (start - doffset) >> cowdev->mushift;
+
+		for (done=0; done < rv; done += cowdev->mapunit, blocknum++) {
+			if (blocknum >= cowdev->numblocks)
+				return;
 
 			/*
 			** if this datablock contains real data (not binary
 			** zeroes), set the corresponding bit in the bitmap
 			*/
-			if ( memcmp(databuf, allzeroes, MAPUNIT) == 0)
+			if (cowlo_iszero(databuf+done, rv - done < cowdev->mapunit ?
+			                       rv - done : cowdev->mapunit))
 				continue;
 
-			mapnum  = CALCMAP (blocknum);
-			mapbyte = CALCBYTE(blocknum);
-			mapbit  = CALCBIT (blocknum);
-
-			*(*(cowdev->mapcache+mapnum)+mapbyte) |= (1<<mapbit);
-		}
-
-		printk(KERN_NOTICE "cowloop - cowfile recovery completed\n");
-	}
-
-	/*
-	** count all bits set in the bitmaps for statistical purposes
-	*/
-	for (i=0, cowdev->nrcowblocks = 0; i < cowdev->mapcount; i++) {
-		long	numbytes;
-		char	*p;
-
-		if (i < (cowdev->mapcount-1))
-			numbytes = MAPCHUNKSZ;
-		else
-			numbytes = cowdev->mapremain;
-
-		p = *(cowdev->mapcache+i);
-
-		for (numbytes--; numbytes >= 0; numbytes--, p++) {
-			/*
-			** for only eight checks the following construction
-			** is faster than a loop-construction
-			*/
-			if ((*p) & 0x01)	cowdev->nrcowblocks++;
-			if ((*p) & 0x02)	cowdev->nrcowblocks++;
-			if ((*p) & 0x04)	cowdev->nrcowblocks++;
-			if ((*p) & 0x08)	cowdev->nrcowblocks++;
-			if ((*p) & 0x10)	cowdev->nrcowblocks++;
-			if ((*p) & 0x20)	cowdev->nrcowblocks++;
-			if ((*p) & 0x40)	cowdev->nrcowblocks++;
-			if ((*p) & 0x80)	cowdev->nrcowblocks++;
+			*(*(cowdev->mapcache+CALCMAP(blocknum)) +
+				CALCBYTE(blocknum)) |= (1<<CALCBIT(blocknum));
 		}
 	}
-
-	/*
-	** consistency-check for number of bits set in bitmap
-	*/
-	if ( !(cowdev->cowhead->flags & COWDIRTY) &&
-	    (cowdev->cowhead->cowused != cowdev->nrcowblocks) ) {
-		printk(KERN_ERR "cowloop - inconsistent cowfile admi\n");
-		return -EINVAL;
-	}
-
-	return 0;
 }
 
 /*
@@ -2632,13 +7064,79 @@ cowlo_undo_opencow(struct cowloop_device *cowdev)
 
 	if (cowdev->mapcache) {
 		for (i=0; i < cowdev->mapcount; i++) {
-			if (*(cowdev->mapcache+i) != NULL)
+			if (*(cowdev->mapcache+i) != NULL &&
+			    *(cowdev->mapcache+i) != (char *)zerochunk)
 				kfree( *(cowdev->mapcache+i) );
 		}
 
 		kfree(cowdev->mapcache);
 	}
 
+	if (cowdev->mapdirty)
+		kfree(cowdev->mapdirty);
+
+	if (cowdev->slotcache) {
+		for (i=0; i < cowdev->mapcount; i++) {
+			if (*(cowdev->slotcache+i) != NULL)
+				vfree( *(cowdev->slotcache+i) );
+		}
+
+		kfree(cowdev->slotcache);
+		cowdev->slotcache = NULL;
+	}
+
+	if (cowdev->slotused)
+		vfree(cowdev->slotused);
+
+	if (cowdev->slotpend)
+		vfree(cowdev->slotpend);
+
+	if (cowdev->slotstage)
+		vfree(cowdev->slotstage);
+
+	cowdev->slotused = cowdev->slotpend = cowdev->slotstage = NULL;
+
+	if (cowdev->slotrefs)
+		vfree(cowdev->slotrefs);
+
+	if (cowdev->slothash)
+		vfree(cowdev->slothash);
+
+	if (cowdev->deduptab)
+		vfree(cowdev->deduptab);
+
+	cowdev->slotrefs = NULL;
+	cowdev->slothash = NULL;
+	cowdev->deduptab = NULL;
+
+	if (cowdev->comp) {
+		for (i=0; i < cowdev->nrcomp; i++) {
+			if ((cowdev->comp+i)->tfm)
+				crypto_free_comp((cowdev->comp+i)->tfm);
+
+			if ((cowdev->comp+i)->blockbuf)
+				vfree((cowdev->comp+i)->blockbuf);
+
+			if ((cowdev->comp+i)->compbuf)
+				vfree((cowdev->comp+i)->compbuf);
+
+			if ((cowdev->comp+i)->dedupbuf)
+				vfree((cowdev->comp+i)->dedupbuf);
+		}
+
+		kfree(cowdev->comp);
+		cowdev->comp	 = NULL;
+		cowdev->compfree = NULL;
+	}
+
+	if (cowdev->jrec)
+		kfree(cowdev->jrec);
+
+	if (cowdev->bufpool)
+		mempool_destroy(cowdev->bufpool);
+
+	cowdev->bufpool = NULL;
+
 	if (cowdev->cowhead)
 		kfree(cowdev->cowhead);
 
@@ -2652,15 +7150,86 @@ cowlo_undo_opencow(struct cowloop_device *cowdev)
 }
 
 /*
-** flush the entire bitmap and the cowhead (clean) to the cowfile
+** flush the modified bitmap chunks of one cowdevice to the cowfile
+** (the modified slot map chunks for a dense cowfile)
+**
+** returns:
+**	>= 0	- number of bytes written
+**	<  0	- write failure (failed chunk still marked modified)
+*/
+static long int
+cowlo_flushmap(struct cowloop_device *cowdev)
+{
+	int		i;
+	loff_t		offset;
+	long int	syncbytes;
+	void		*chunk;
+
+	for (i=0, offset=cowdev->mapunit, syncbytes=0; i < cowdev->mapcount;
+				i++, offset += MAPCHUNKSZ) {
+		unsigned long	numbytes;
+
+		/*
+		** skip bitmap chunks that have not been modified
+		*/
+		if ( !test_and_clear_bit(i, cowdev->mapdirty) )
+			continue;
+
+		if (cowdev->cowhead->flags & COWDENSE) {
+			/*
+			** slot map chunk
+			*/
+			numbytes = SLOTCHUNKSZ(cowdev, i);
+			chunk	 = *(cowdev->slotcache+i);
+
+			if (cowlo_writecowraw(cowdev, chunk, numbytes,
+				     SLOTCHUNKOFF(cowdev, i)) < numbytes) {
+				set_bit(i, cowdev->mapdirty);
+				return -1;
+			}
+
+			syncbytes += numbytes;
+			continue;
+		}
+
+		if (i < (cowdev->mapcount-1))
+			/*
+			** full bitmap chunk
+			*/
+			numbytes = MAPCHUNKSZ;
+		else
+			/*
+			** last bitmap chunk: might be partly filled
+			*/
+			numbytes = cowdev->mapremain;
+
+		DEBUGP(DCOW
+		       "cowloop - flushing bitmap %2d (%3ld Kb)\n",
+						i, numbytes/1024);
+
+		chunk = *(cowdev->mapcache+i);
+
+		if (cowlo_writecowraw(cowdev, chunk, numbytes, offset) <
+								numbytes) {
+			set_bit(i, cowdev->mapdirty);
+			return -1;
+		}
+
+		syncbytes += numbytes;
+	}
+
+	return syncbytes;
+}
+
+/*
+** flush the modified bitmap chunks and the cowhead (clean) to the cowfile
 **
 ** must be called with the cowdevices-lock set
 */
 static void
 cowlo_sync(void)
 {
-	int			i, minor;
-	loff_t			offset;
+	int			minor;
 	struct cowloop_device	*cowdev;
 
 	for (minor=0; minor < maxcows;  minor++) {
@@ -2668,42 +7237,194 @@ cowlo_sync(void)
 		if ( ! (cowdev->state & COWRWCOWOPEN) )
 			continue;
 
-		for (i=0, offset=MAPUNIT; i < cowdev->mapcount;
-					i++, offset += MAPCHUNKSZ) {
-			unsigned long	numbytes;
-
-			if (i < (cowdev->mapcount-1))
-				/*
-				** full bitmap chunk
-				*/
-				numbytes = MAPCHUNKSZ;
-			else
-				/*
-				** last bitmap chunk: might be partly filled
-				*/
-				numbytes = cowdev->mapremain;
-
-			DEBUGP(DCOW
-			       "cowloop - flushing bitmap %2d (%3ld Kb)\n",
-							i, numbytes/1024);
-
-			if (cowlo_writecowraw(cowdev, *(cowdev->mapcache+i),
-						numbytes, offset) < numbytes) {
-				break;
-			}
+		if ( !(cowdev->cowhead->flags & COWDENSE) ) {
+			cowlo_syncdev(cowdev);
+			continue;
 		}
 
 		/*
-		** flush clean up-to-date cowhead to cowfile
+		** the slots freed before the flush of a dense cowfile
+		** are free once the slot map is on disk (serialized with
+		** commits, which release slots as well)
 		*/
+		down(&cowdev->commitsem);
+
+		if (cowlo_syncdev(cowdev) && cowlo_fsync(cowdev) == 0)
+			cowlo_slotrelease(cowdev);
+
+		up(&cowdev->commitsem);
+	}
+}
+
+/*
+** flush the modified bitmap chunks and the cowhead (clean) of one
+** cowdevice to the cowfile
+**
+** returns:
+** 	0   - fail
+**      1   - success
+*/
+static int
+cowlo_syncdev(struct cowloop_device *cowdev)
+{
+	long int	syncbytes;
+	int		rv;
+
+	/*
+	** avoid that the bitmap is modified by one of the
+	** kernel-threads while it is being flushed
+	*/
+	down_write(&cowdev->cowsem);
+
+	/*
+	** the slots of a dense cowfile must be on disk before the
+	** slot map that refers to them
+	*/
+	if ( (cowdev->cowhead->flags & COWDENSE) && cowlo_fsync(cowdev) < 0 )
+		syncbytes = -EIO;
+	else
+		syncbytes = cowlo_flushmap(cowdev);
+
+	/*
+	** with a complete bitmap on disk, the records in the
+	** journal are obsolete: start a new generation (the bitmap
+	** must be on disk before the cowhead with that generation)
+	*/
+	if ( (cowdev->cowhead->flags & COWJOURNAL) && syncbytes >= 0 &&
+	     cowlo_fsync(cowdev) < 0 )
+		syncbytes = -EIO;
+
+	if ( (cowdev->cowhead->flags & COWJOURNAL) && syncbytes >= 0) {
+		cowdev->cowhead->jgen++;
+		cowdev->jslot = 0;
+	}
+
+	/*
+	** with the slot map on disk, the slots freed so far are no
+	** longer referred to (after the next sync of the cowfile)
+	*/
+	if ( (cowdev->cowhead->flags & COWDENSE) && syncbytes >= 0) {
+		cowlo_slotstage(cowdev);
+		cowdev->cowhead->nextslot = cowdev->nextslot;
+	}
+
+	/*
+	** flush clean up-to-date cowhead to cowfile, but only when the
+	** bitmap is complete on disk (the cowfile stays dirty otherwise)
+	*/
+	if (syncbytes < 0) {
+		rv = 0;
+		cowdev->syncbytes = 0;
+	} else {
+		rv = 1;
+
 		cowdev->cowhead->cowused	 = cowdev->nrcowblocks;
 		cowdev->cowhead->flags		&= ~COWDIRTY;
 
 		DEBUGP(DCOW "cowloop - flushing cowhead (%3d Kb)\n",
-							MAPUNIT/1024);
+							COWHEADSZ/1024);
+
+		if (cowlo_writecowraw(cowdev, cowdev->cowhead, COWHEADSZ,
+							(loff_t) 0) < COWHEADSZ)
+			rv = 0;
+
+		cowdev->syncbytes = syncbytes + COWHEADSZ;
+	}
+
+	cowdev->nrsyncs++;
+
+	DEBUGP(DCOW "cowloop - sync wrote %lu bytes\n",
+						cowdev->syncbytes);
+
+	up_write(&cowdev->cowsem);
+
+	return rv;
+}
+
+/*
+** make all writes that have been ended so far durable: the bitmap
+** and the cowhead are flushed and the cowfile is synced to disk
+**
+** flushes that arrive while a commit is in progress wait for it and
+** are served together by the next commit (group commit), so that
+** many concurrent flushes only cost a few syncs of the cowfile
+**
+** returns:
+** 	0   - fail
+**      1   - success
+*/
+static int
+cowlo_commit(struct cowloop_device *cowdev)
+{
+	unsigned int	ticket, upto;
+	int		rv = 1;
+
+	if ( !(cowdev->state & COWRWCOWOPEN) )
+		return 1;		/* nothing can have been written */
+
+	ticket = atomic_inc_return(&cowdev->commitreqs);
+
+	down(&cowdev->commitsem);
 
-		cowlo_writecowraw(cowdev, cowdev->cowhead, MAPUNIT, (loff_t) 0);
+	cowdev->flushes++;
+
+	/*
+	** a commit that started after this flush arrived has already
+	** been done meanwhile
+	*/
+	if ((int)(cowdev->commitok - ticket) >= 0) {
+		up(&cowdev->commitsem);
+		return 1;
+	}
+
+	if ((int)(cowdev->commitdone - ticket) >= 0) {
+		up(&cowdev->commitsem);
+		return 0;
 	}
+
+	/*
+	** this commit serves all flushes that arrived so far;
+	** with a journal, the bitmap updates are already in the cowfile
+	*/
+	upto = atomic_read(&cowdev->commitreqs);
+
+	if ( !(cowdev->cowhead->flags & COWJOURNAL) )
+		rv = cowlo_syncdev(cowdev);
+
+	if (cowlo_fsync(cowdev) < 0)
+		rv = 0;
+	else if (rv && (cowdev->cowhead->flags & COWDENSE))
+		cowlo_slotrelease(cowdev);
+
+	cowdev->commits++;
+	cowdev->commitdone = upto;
+
+	if (rv)
+		cowdev->commitok = upto;
+	else
+		printk(KERN_ERR "cowloop - commit of cowfile %s failed\n",
+							cowdev->cowname);
+
+	up(&cowdev->commitsem);
+
+	return rv;
+}
+
+/*
+** sync the cowfile to disk
+**
+** returns:
+** 	0   - okay
+**    < 0   - error value
+*/
+static int
+cowlo_fsync(struct cowloop_device *cowdev)
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,35))
+	return vfs_fsync(cowdev->cowfp, 1);
+#else
+	return vfs_fsync(cowdev->cowfp, cowdev->cowfp->f_dentry, 1);
+#endif
 }
 
 /*****************************************************************************/
@@ -2738,6 +7459,34 @@ cowlo_init_module(void)
                 maxcows = DFLCOWS;
         }
 
+	if ((nrthreads < 1) || (nrthreads > MAXTHREADS)) {
+		printk(KERN_WARNING
+		       "cowloop - nrthreads should be between 1 and %d\n",
+								MAXTHREADS);
+		nrthreads = DFLTHREADS;
+	}
+
+	if ((qdepth < nrthreads) || (qdepth > MAXQDEPTH)) {
+		printk(KERN_WARNING
+		       "cowloop - qdepth should be between %d and %d\n",
+							nrthreads, MAXQDEPTH);
+		qdepth = nrthreads > DFLQDEPTH ? nrthreads : DFLQDEPTH;
+	}
+
+	if ((aiothreads < 1) || (aiothreads > MAXAIOTHREADS)) {
+		printk(KERN_WARNING
+		       "cowloop - aiothreads should be between 1 and %d\n",
+								MAXAIOTHREADS);
+		aiothreads = DFLAIOTHREADS;
+	}
+
+	if ((readahead < 0) || (readahead > MAXREADAHEAD)) {
+		printk(KERN_WARNING
+		       "cowloop - readahead should be between 0 and %d\n",
+								MAXREADAHEAD);
+		readahead = DFLREADAHEAD;
+	}
+
 	/* allocate room for a table with a pointer to each cowloop_device: */
         if ( (cowdevall = kmalloc(maxcows * sizeof(struct cowloop_device *),
 							GFP_KERNEL)) == NULL) {
@@ -2787,15 +7536,45 @@ cowlo_init_module(void)
 	*/
 	if( (rdofile[0] != '\0') && (cowfile[0] != '\0') ) {
 		char	*po = option;
-		int	wantrecover = 0;
+		int	wantrecover = 0, pairflags = 0;
 
 		/*
-		** check if automatic recovery is wanted
+		** check if automatic recovery, asynchronous I/O
+		** or a journal is wanted
 		*/
 		while (*po) {
-			if (*po == 'r') {
+			switch (*po) {
+			   case 'r':
 				wantrecover = 1;
 				break;
+
+			   case 'a':
+				pairflags |= PAIRAIO;
+				break;
+
+			   case 'j':
+				pairflags |= PAIRJOURNAL;
+				break;
+
+			   case 'z':
+				pairflags |= PAIRZERO;
+				break;
+
+			   case 'n':
+				pairflags |= PAIRNOCACHE;
+				break;
+
+			   case 'd':
+				pairflags |= PAIRDENSE;
+				break;
+
+			   case 'c':
+				pairflags |= PAIRCOMPRESS;
+				break;
+
+			   case 'u':
+				pairflags |= PAIRDEDUP;
+				break;
                         }
 			po++;
 		}
@@ -2803,7 +7582,8 @@ cowlo_init_module(void)
 		/*
 		** open new cowdevice with minor number 0
 		*/
-		if ( (rv = cowlo_openpair(rdofile, cowfile, wantrecover, 0))) {
+		if ( (rv = cowlo_openpair(rdofile, cowfile, wantrecover, 0,
+					pairflags, dflmapunit, NULL, 0))) {
 			remove_proc_entry("cow", NULL);
 			unregister_blkdev(COWMAJOR, DEVICE_NAME);
 			goto error_out;
@@ -1,26 +1,158 @@
 /*
 ** DO NOT MODIFY THESE VALUES (would make old cowfiles unusable)
+**
+** version 1 cowfiles always use a MAPUNIT of 1 Kb; in version 2
+** cowfiles the field mapunit of the cowhead is honoured, which can be
+** any power of two between MINMAPUNIT and MAXMAPUNIT
+** the cowhead (MAPUNIT bytes) is followed by the bitmap at offset
+** mapunit; the bitmap is rounded to multiples of MAPUNIT bytes
+**
+** in version 3 cowfiles with a dense layout (flag COWDENSE), a map
+** with one slot number per block is found at offset mapunit instead
+** of the bitmap; written blocks are stored in slots of mapunit bytes
+** that are allocated in sequence (slot 1 at the data offset)
+**
+** in version 4 cowfiles with compressed blocks (flag COWCOMPRESS, always
+** with a dense layout), the slot map has two unsigned ints per block:
+** the slot number and the length of the compressed data in the slot
+** (0: block stored uncompressed)
+**
+** in version 5 cowfiles with deduplication (flag COWDEDUP, always with
+** a dense layout), several blocks with the same contents may refer to
+** the same slot
 */
-#define	MAPUNIT		1024		/* blocksize for bit in bitmap       */
-#define	MUSHIFT		10		/* bitshift  for bit in bitmap       */
-#define	MUMASK		0x3ff		/* bitmask   for bit in bitmap       */
+#define	MAPUNIT		1024		/* blocksize for bit in bitmap (v1)  */
+#define	MUSHIFT		10		/* bitshift  for bit in bitmap (v1)  */
+#define	MUMASK		0x3ff		/* bitmask   for bit in bitmap (v1)  */
+
+#define	MINMAPUNIT	1024		/* smallest blocksize for v2 cowfile */
+#define	MAXMAPUNIT	(1024*1024)	/* largest  blocksize for v2 cowfile */
+
+#define	COWFPUNIT	1024		/* blocksize to fingerprint rdofile  */
 
 #define	COWMAGIC	0x574f437f	/* byte-swapped '7f C O W'           */
 #define	COWDIRTY	0x01
 #define	COWPACKED	0x02
-#define	COWVERSION	1
+#define	COWJOURNAL	0x04		/* journal of bitmap updates present */
+#define	COWDENSE	0x08		/* dense layout with slot map        */
+#define	COWCOMPRESS	0x10		/* compressed blocks in slots        */
+#define	COWDEDUP	0x20		/* slots shared by identical blocks  */
+#define	COWVERSION	5
+
+#define	COWNOSLOT	0		/* slot map: block not in cowfile    */
+#define	COWZEROSLOT	0xffffffff	/* slot map: block of binary zeroes  */
 
+/*
+** all fields of the cowhead have a fixed width, so a cowfile can be
+** moved between 32-bit and 64-bit systems (the layout is identical to
+** the cowhead as written before by 64-bit systems)
+*/
 struct cowhead
 {
 	int		magic;		/* identifies a cowfile              */
 	short		version;	/* version of cowhead                */
 	short		flags;    	/* flags indicating status           */
-	unsigned long	mapunit;	/* blocksize per bit in bitmap       */
-	unsigned long	mapsize;	/* total size of bitmap (bytes)      */
-	unsigned long	doffset;	/* start-offset datablocks in cow    */
-	unsigned long	rdoblocks;	/* size of related read-only file    */
-	unsigned long	rdofingerprint;	/* fingerprint of read-only file     */
-	unsigned long	cowused;	/* number of datablocks used in cow  */
+	unsigned long long mapunit;	/* blocksize per bit in bitmap       */
+	unsigned long long mapsize;	/* total size of bitmap (bytes)      */
+	unsigned long long doffset;	/* start-offset datablocks in cow    */
+	unsigned long long rdoblocks;	/* size of related read-only file    */
+	unsigned long long rdofingerprint; /* fingerprint of read-only file  */
+	unsigned long long cowused;	/* number of datablocks used in cow  */
+
+	/*
+	** version 2: journal of bitmap updates (only valid when
+	** flag COWJOURNAL is set; zero in version 1 cowfiles)
+	*/
+	unsigned long long joffset;	/* start-offset journal in cow       */
+	unsigned long long jsize;	/* total size of journal (bytes)     */
+	unsigned long long jgen;	/* generation of valid journal recs  */
+
+	/*
+	** version 3: slot map of a dense cowfile (only valid when
+	** flag COWDENSE is set; the map has an unsigned int per block)
+	*/
+	unsigned long long soffset;	/* start-offset slot map in cow      */
+	unsigned long long ssize;	/* total size of slot map (bytes)    */
+	unsigned long long nextslot;	/* first slot that was never used    */
+};
+
+/*
+** cowhead as written before by 32-bit systems; such a cowhead is
+** recognized by a mapunit that is out of range in struct cowhead
+** (its mapunit and mapsize are combined in one field there)
+*/
+struct cowhead32
+{
+	int		magic;		/* identifies a cowfile              */
+	short		version;	/* version of cowhead                */
+	short		flags;    	/* flags indicating status           */
+	unsigned int	mapunit;	/* blocksize per bit in bitmap       */
+	unsigned int	mapsize;	/* total size of bitmap (bytes)      */
+	unsigned int	doffset;	/* start-offset datablocks in cow    */
+	unsigned int	rdoblocks;	/* size of related read-only file    */
+	unsigned int	rdofingerprint;	/* fingerprint of read-only file     */
+	unsigned int	cowused;	/* number of datablocks used in cow  */
+	unsigned int	joffset;	/* start-offset journal in cow       */
+	unsigned int	jsize;		/* total size of journal (bytes)     */
+	unsigned int	jgen;		/* generation of valid journal recs  */
+};
+
+#define	COWHEAD32(h)	((h)->mapunit < MINMAPUNIT || \
+			 (h)->mapunit > MAXMAPUNIT)
+
+/*
+** convert a cowhead written by a 32-bit system (in place) to the
+** fixed-width cowhead
+*/
+static inline void
+cowconvhead(struct cowhead *cowhead)
+{
+	struct cowhead32	h32 = *(struct cowhead32 *)cowhead;
+
+	cowhead->magic		= h32.magic;
+	cowhead->version	= h32.version;
+	cowhead->flags		= h32.flags;
+	cowhead->mapunit	= h32.mapunit;
+	cowhead->mapsize	= h32.mapsize;
+	cowhead->doffset	= h32.doffset;
+	cowhead->rdoblocks	= h32.rdoblocks;
+	cowhead->rdofingerprint	= h32.rdofingerprint;
+	cowhead->cowused	= h32.cowused;
+
+	cowhead->joffset	= h32.version >= 2 ? h32.joffset : 0;
+	cowhead->jsize		= h32.version >= 2 ? h32.jsize   : 0;
+	cowhead->jgen		= h32.version >= 2 ? h32.jgen    : 0;
+
+	cowhead->soffset	= 0;
+	cowhead->ssize		= 0;
+	cowhead->nextslot	= 0;
+}
+
+/*
+** the journal consists of slots of COWJRECSZ bytes; every slot may
+** contain one record describing the extents of blocks that have been
+** written to the cowfile for the first time
+** only records with the generation of the cowhead are valid: the
+** generation is incremented whenever the bitmap has been flushed
+*/
+#define	COWJMAGIC	0x4a574f43	/* 'C O W J'                         */
+#define	COWJRECSZ	512		/* size of one journal slot          */
+#define	COWJOURNALSZ	(64*1024)	/* journal size for new cowfiles     */
+#define	COWJEXTS	31		/* extents per journal record        */
+
+struct cowjext
+{
+	unsigned long long first;	/* first block of extent             */
+	unsigned long long count;	/* number of blocks in extent        */
+};
+
+struct cowjrec
+{
+	int		magic;		/* identifies a journal record       */
+	short		nrext;		/* number of extents in this record  */
+	short		spare;
+	unsigned long long jgen;	/* generation of this record         */
+	struct cowjext	ext[COWJEXTS];	/* newly written extents of blocks   */
 };
 
 #define COWDEVDIR	"/dev/cow/"
@@ -38,6 +170,13 @@ struct cowhead
 */
 #define ANYDEV		((unsigned long)-1)
 
+/*
+** a cowdevice may have a chain of read-only cowfiles between the rdofile
+** and the cowfile (lowfiles: pathnames from the lowest one upwards, each
+** pathname terminated by a null byte)
+*/
+#define	COWMAXLAYERS	16		/* maximum lower cowfiles per device */
+
 struct cowpair
 {
 	unsigned char	*rdofile;	/* pathname of the rdofile           */
@@ -45,8 +184,20 @@ struct cowpair
 	unsigned short	rdoflen;	/* length of rdofile pathname        */
 	unsigned short	cowflen;	/* length of cowfile pathname        */
 	unsigned long	device;		/* requested/returned device number  */
+	unsigned long	flags;		/* options for this cowdevice        */
+	unsigned long	mapunit;	/* blocksize new cowfile (0: default)*/
+	unsigned char	*lowfiles;	/* pathnames of lower cowfiles       */
+	unsigned long	lowflen;	/* total length of these pathnames   */
 };
 
+#define	PAIRAIO		0x01		/* asynchronous I/O on backing files */
+#define	PAIRJOURNAL	0x02		/* new cowfile with journal          */
+#define	PAIRZERO	0x04		/* no data for blocks with zeroes    */
+#define	PAIRNOCACHE	0x08		/* drop backing pages after use      */
+#define	PAIRDENSE	0x10		/* new cowfile with dense layout     */
+#define	PAIRCOMPRESS	0x20		/* new cowfile, compressed blocks    */
+#define	PAIRDEDUP	0x40		/* new cowfile, deduplicated blocks  */
+
 struct cowwatch
 {
 	int      	flags;		/* request flags                     */
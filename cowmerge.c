@@ -63,7 +63,8 @@ static unsigned long	calcsum(int, char *, int);
 int
 main(int argc, char *argv[])
 {
-	int		fdrdo, fdcow, bytenum, bitnum, modifications=0;
+	int		fdrdo, fdcow, bitnum;
+	unsigned long long bytenum, blocknum, modifications=0;
 	char		*progname = argv[0],
 			*rdofile  = argv[1],
 			*cowfile  = argv[2];
@@ -102,12 +103,26 @@ main(int argc, char *argv[])
 		exit(1);
 	}
 
-	if (cowhead.version != COWVERSION) {
+	if (cowhead.version > COWVERSION) {
 		fprintf(stderr,
 		        "version of cowfile %s not supported\n", cowfile);
 		exit(1);
 	}
 
+	if ( COWHEAD32(&cowhead) ) {
+		fprintf(stderr,
+		        "cowfile %s has a 32-bit cowhead (cowrepair needed)\n",
+			cowfile);
+		exit(1);
+	}
+
+	if (cowhead.flags & COWDENSE) {
+		fprintf(stderr,
+			"cowfile %s has a dense layout (not supported)\n",
+			cowfile);
+		exit(1);
+	}
+
 	if (cowhead.flags &= COWPACKED) {
 		fprintf(stderr,
 			"cowfile %s is packed (cowpack -u needed)\n", cowfile);
@@ -123,7 +138,7 @@ main(int argc, char *argv[])
 	** allocate space for entire bitmap and read it into memory
 	*/
 	if ( (bitmap = malloc(cowhead.mapsize)) == NULL) {
-		fprintf(stderr, "cannot allocate %lu bytes for bitmap\n",
+		fprintf(stderr, "cannot allocate %llu bytes for bitmap\n",
 		                cowhead.mapsize);
 		exit(1);
 	}
@@ -144,7 +159,7 @@ main(int argc, char *argv[])
 	** allocate space to read modified data blocks from cowfile
 	*/
 	if ( (cowbuf = malloc(cowhead.mapunit)) == NULL) {
-		fprintf(stderr, "cannot allocate %lu bytes for data0block\n",
+		fprintf(stderr, "cannot allocate %llu bytes for data0block\n",
 		                cowhead.mapunit);
 		exit(1);
 	}
@@ -164,7 +179,7 @@ main(int argc, char *argv[])
 	** be sure that the fingerprint of the cowfile corresponds with
 	** this rdofile
 	*/
-	if ( calcsum(fdrdo, cowbuf, cowhead.mapunit) != cowhead.rdofingerprint){
+	if ( calcsum(fdrdo, cowbuf, COWFPUNIT) != cowhead.rdofingerprint){
 		fprintf(stderr,
 			"%s - fingerprint of %s does not correspond with %s\n",
 			progname, rdofile, cowfile);
@@ -196,11 +211,13 @@ main(int argc, char *argv[])
 			if ( *(bitmap+bytenum) & (1<<bitnum)) {	/* bit set ? */
 				modifications++;
 
+				blocknum = bytenum*8 + bitnum;
+
 				/*
 				** seek datablock in cowfile and read it
 				*/
 				offset = (off_t)cowhead.doffset +
-				         ((bytenum*8+bitnum) * cowhead.mapunit);
+				         (off_t)blocknum * cowhead.mapunit;
 
 				if (lseek(fdcow, offset, SEEK_SET) == -1) {
 					perror("lseek cowfile");
@@ -216,8 +233,7 @@ main(int argc, char *argv[])
 				/*
 				** seek datablock in rdofile and write it
 				*/
-				offset = (off_t)(bytenum*8+bitnum) *
-				                 cowhead.mapunit;
+				offset = (off_t)blocknum * cowhead.mapunit;
 
 				if (lseek(fdrdo, offset, SEEK_SET) == -1) {
 					perror("lseek rdofile");
@@ -236,7 +252,7 @@ main(int argc, char *argv[])
 	close(fdcow);
 	close(fdrdo);
 
-	printf("Number of blocks modified in %s: %d\n",
+	printf("Number of blocks modified in %s: %llu\n",
 					rdofile, modifications);
 
 	exit(0);
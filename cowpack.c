@@ -387,15 +387,25 @@ validatecowheader(struct cowhead* cowhead, char mode) {
 	exit(1);
     }
     
-    if (cowhead->version != COWVERSION) {
+    if (cowhead->version > COWVERSION) {
 	fputs("Version of cowfile not supported\n", stderr);
 	exit(1);
     }
+
+    if ( COWHEAD32(cowhead) ) {
+	fputs("Cowfile has a 32-bit cowhead (cowrepair needed)\n", stderr);
+	exit(1);
+    }
     
     if ( cowhead->flags & COWDIRTY ) {
 	fputs("Cowfile is dirty\n", stderr);
 	exit(1);
     }
+
+    if ( cowhead->flags & COWDENSE ) {
+	fputs("Cowfile has a dense layout (not supported)\n", stderr);
+	exit(1);
+    }
     if (mode == 'p') cowhead->flags |=  COWPACKED;
     else             cowhead->flags &= ~COWPACKED;
 }
@@ -73,10 +73,12 @@ static void prusage(char *);
 int
 main(int argc, char *argv[])
 {
-	long int	i, c, fd, bnum, modified, bytenr, bitnr;
+	long int	i, c, fd, modified, bitnr;
+	long long	bnum, bytenr;
 	char		*cowfile, *buf, *nullbuf, *bitmap;
 	struct cowhead	cowhead;
 	char		forcedflag = 0, nomodflag = 0, verboseflag = 0;
+	char		scanflag = 0, convflag = 0;
 	off_t		offset;
 
 	/*
@@ -90,7 +92,7 @@ main(int argc, char *argv[])
 	/*
 	** handle flags
  	*/
-	while ( (c=getopt(argc, argv, "fnv")) != EOF) {
+	while ( (c=getopt(argc, argv, "fnsv")) != EOF) {
 		switch (c) {
 		   case 'f':
 			forcedflag++;
@@ -100,6 +102,10 @@ main(int argc, char *argv[])
 			nomodflag++;
 			break;
 
+		   case 's':
+			scanflag++;
+			break;
+
 		   case 'v':
 			verboseflag++;
 			break;
@@ -139,19 +145,48 @@ main(int argc, char *argv[])
 		exit(1);
 	}
 
-	if (cowhead.version != COWVERSION) {
+	/*
+	** a cowhead written by a 32-bit system is rewritten with fixed-width
+	** fields; its journal records have another layout as well, so the
+	** data blocks have to be scanned instead
+	*/
+	if ( COWHEAD32(&cowhead) ) {
+		cowconvhead(&cowhead);
+
+		if ( COWHEAD32(&cowhead) ) {
+			fprintf(stderr,
+			        "%s has an invalid cowhead\n", cowfile);
+			exit(1);
+		}
+
+		printf("32-bit cowhead of %s converted\n", cowfile);
+		convflag++;
+		scanflag++;
+	}
+
+	if (cowhead.version > COWVERSION) {
 		fprintf(stderr,
 		        "version of cowfile %s not supported\n", cowfile);
 		exit(1);
 	}
 
-	if (cowhead.flags &= COWPACKED) {
+	if (cowhead.flags & COWPACKED) {
 		fprintf(stderr,
 		       "cowfile %s cannot be repaired while packed\n", cowfile);
 		exit(1);
 	}
 
-	if ( !(cowhead.flags &= COWDIRTY) && !forcedflag) {
+	/*
+	** the slot map of a dense cowfile is consistent as flushed last
+	*/
+	if (cowhead.flags & COWDENSE) {
+		fprintf(stderr,
+		       "cowfile %s has a dense layout (no repair needed)\n",
+			cowfile);
+		exit(0);
+	}
+
+	if ( !(cowhead.flags & COWDIRTY) && !forcedflag && !convflag) {
 		fprintf(stderr, "cowfile %s is not dirty\n", cowfile);
 		exit(0);
 	}
@@ -160,7 +195,7 @@ main(int argc, char *argv[])
 	** allocate space and read entire bitmap into memory
 	*/
 	if ( (bitmap = malloc(cowhead.mapsize)) == NULL) {
-		fprintf(stderr, "cannot allocate %lu bytes for bitmap\n",
+		fprintf(stderr, "cannot allocate %llu bytes for bitmap\n",
 		                cowhead.mapsize);
 		exit(1);
 	}
@@ -177,12 +212,78 @@ main(int argc, char *argv[])
 		exit(1);
 	}
 
+	/*
+	** cowfile with journal: only the blocks logged in the records
+	** of the current generation can be missing in the bitmap
+	*/
+	if ( (cowhead.flags & COWJOURNAL) && !scanflag) {
+		struct cowjrec	*jrec;
+		char		*jbuf;
+		long int	slot, e;
+
+		if ( (jbuf = malloc(cowhead.jsize)) == NULL) {
+			fprintf(stderr, "cannot allocate %llu bytes for journal\n",
+		                cowhead.jsize);
+			exit(1);
+		}
+
+		offset = cowhead.joffset;
+
+		if (lseek(fd, offset, SEEK_SET) == -1) {
+			perror("lseek to journal");
+			exit(1);
+		}
+
+		if ( read(fd, jbuf, cowhead.jsize) < cowhead.jsize) {
+			perror("read journal");
+			exit(1);
+		}
+
+		for (slot=0, modified=0; slot < cowhead.jsize / COWJRECSZ;
+								slot++) {
+			jrec = (struct cowjrec *)(jbuf + slot * COWJRECSZ);
+
+			if (jrec->magic != COWJMAGIC   ||
+			    jrec->jgen  != cowhead.jgen ||
+			    jrec->nrext <  0 || jrec->nrext > COWJEXTS)
+				continue;	/* stale or unused slot */
+
+			for (e=0; e < jrec->nrext; e++) {
+				for (bnum  = jrec->ext[e].first;
+				     bnum  < jrec->ext[e].first +
+				             jrec->ext[e].count &&
+				     bnum  < cowhead.rdoblocks; bnum++) {
+					bytenr	= CALCBYTE(bnum);
+					bitnr	= CALCBIT (bnum);
+
+					if ( *(bitmap+bytenr)&(1<<bitnr) )
+						continue;
+
+					modified++;
+
+					if (verboseflag) {
+						printf("data block %9lld in "
+						       "journal not marked in "
+						       "bitmap; corrected\n",
+						       bnum);
+					}
+
+					*(bitmap+bytenr) |= 1<<bitnr;
+				}
+			}
+		}
+
+		free(jbuf);
+
+		goto rewrite;
+	}
+
 	/*
 	** fill a buffer with binary zeroes to compare against
 	** the data-block which is read from the cowfile
 	*/
 	if ( (nullbuf = malloc(cowhead.mapunit)) == NULL) {
-		fprintf(stderr, "cannot allocate %lu bytes for null bytes\n",
+		fprintf(stderr, "cannot allocate %llu bytes for null bytes\n",
 		                cowhead.mapunit);
 		exit(1);
 	}
@@ -190,7 +291,7 @@ main(int argc, char *argv[])
 	memset(nullbuf, 0, cowhead.mapunit);
 
 	if ( (buf = malloc(cowhead.mapunit)) == NULL) {
-		fprintf(stderr, "cannot allocate %lu bytes for datablock\n",
+		fprintf(stderr, "cannot allocate %llu bytes for datablock\n",
 		                cowhead.mapunit);
 		exit(1);
 	}
@@ -235,7 +336,7 @@ main(int argc, char *argv[])
 		modified++;
 
 		if (verboseflag) {
-			printf("data block %9lu (offset %11llu) not marked "
+			printf("data block %9lld (offset %11llu) not marked "
 			       "in bitmap; corrected\n",
 				bnum,
 				(unsigned long long)bnum * cowhead.mapunit);
@@ -247,6 +348,7 @@ main(int argc, char *argv[])
 	/*
 	** rewrite the modified bitmap to the cowfile
 	*/
+rewrite:
 	if (!nomodflag && modified) {
 		offset = cowhead.mapunit;
 
@@ -278,6 +380,12 @@ main(int argc, char *argv[])
 
 	cowhead.flags &= ~COWDIRTY;
 
+	/*
+	** the bitmap is complete now: invalidate the journal records
+	*/
+	if (cowhead.flags & COWJOURNAL)
+		cowhead.jgen++;
+
 	if (!nomodflag) {
 		if (lseek(fd, (off_t)0, SEEK_SET) == -1) {
 			perror("lseek to cowhead");
@@ -302,14 +410,18 @@ main(int argc, char *argv[])
 	exit(0);
 }
 
+
 static void
 prusage(char *pname)
 {
-	fprintf(stderr, "Usage: %s [-f] [-n] [-v[v]] cowfile\n\n", pname);
+	fprintf(stderr, "Usage: %s [-f] [-n] [-s] [-v[v]] cowfile\n\n", pname);
 	fprintf(stderr,
 		"   -f   forced:   repair cowfile which is not dirty\n");
 	fprintf(stderr,
 		"   -n   nomodify: do not modify cowfile (fake mode)\n");
+	fprintf(stderr,
+		"   -s   scan:     read all data blocks, even if the "
+		"cowfile has a journal\n");
 	fprintf(stderr,
 		"   -v   verbose:  provide extra info\n");
 }